@@ -11,6 +11,7 @@
 #include "condVar.h"
 #include <linux/unistd.h>
 #include <malloc.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <sys/resource.h>
@@ -201,6 +202,17 @@ void cThread::SetIOPriority(int Priority)
      LOG_ERROR;
 }
 
+void cThread::SetAffinity(int Cpu)
+{
+  if (Cpu < 0)
+     return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(Cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) < 0)
+     LOG_ERROR;
+}
+
 void cThread::SetDescription(const char *Description, ...)
 {
   free(description);
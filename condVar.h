@@ -95,6 +95,9 @@ private:
 protected:
   void SetPriority(int Priority);
   void SetIOPriority(int Priority);
+  void SetAffinity(int Cpu);
+       ///< Restricts the calling thread to the given CPU. A negative value
+       ///< leaves the affinity untouched.
   void Lock(void) { mutex.Lock(); }
   void Unlock(void) { mutex.Unlock(); }
   virtual void Action(void) = 0;
@@ -423,6 +423,15 @@ void cOmx::OnBufferEmpty(void *instance, COMPONENT_T *comp)
 					comp == omx->m_comp[eVideoDecoder] ? eVideoDecoder :
 					comp == omx->m_comp[eAudioRender] ? eAudioRender :
 							eInvalidComponent));
+
+	// buffer is already available again, so notify audio decoder directly
+	// instead of going through the event thread
+	if (comp == omx->m_comp[eAudioRender])
+	{
+		cMutexLock lock(&omx->m_audioBufferEmptiedMutex);
+		if (omx->m_onAudioBufferEmptied)
+			omx->m_onAudioBufferEmptied(omx->m_onAudioBufferEmptiedData);
+	}
 }
 
 void cOmx::OnPortSettingsChanged(void *instance, COMPONENT_T *comp, OMX_U32 data)
@@ -469,7 +478,9 @@ cOmx::cOmx() :
 	m_onEndOfStream(0),
 	m_onEndOfStreamData(0),
 	m_onStreamStart(0),
-	m_onStreamStartData(0)
+	m_onStreamStartData(0),
+	m_onAudioBufferEmptied(0),
+	m_onAudioBufferEmptiedData(0)
 {
 	memset(m_tun, 0, sizeof(m_tun));
 	memset(m_comp, 0, sizeof(m_comp));
@@ -612,6 +623,14 @@ void cOmx::SetStreamStartCallback(void (*onStreamStart)(void*), void* data)
 	m_onStreamStartData = data;
 }
 
+void cOmx::SetAudioBufferEmptiedCallback(
+		void (*onAudioBufferEmptied)(void*), void* data)
+{
+	cMutexLock lock(&m_audioBufferEmptiedMutex);
+	m_onAudioBufferEmptied = onAudioBufferEmptied;
+	m_onAudioBufferEmptiedData = data;
+}
+
 OMX_TICKS cOmx::ToOmxTicks(int64_t val)
 {
 	OMX_TICKS ticks;
@@ -880,33 +899,6 @@ bool cOmx::IsBufferStall(void)
 	return stallConf.bStalled == OMX_TRUE;
 }
 
-void cOmx::SetVolume(int vol)
-{
-	OMX_AUDIO_CONFIG_VOLUMETYPE volume;
-	OMX_INIT_STRUCT(volume);
-	volume.nPortIndex = 100;
-	volume.bLinear = OMX_TRUE;
-	volume.sVolume.nValue = vol * 100 / 255;
-
-// FIXME
-// 	if (OMX_SetConfig(ILC_GET_HANDLE(m_comp[eAudioRender]),
-//			OMX_IndexConfigAudioVolume, &volume) != OMX_ErrorNone)
-//		syslog(LOG_ERR, "[cOmx] failed to set volume!");
-}
-
-void cOmx::SetMute(bool mute)
-{
-	OMX_AUDIO_CONFIG_MUTETYPE amute;
-	OMX_INIT_STRUCT(amute);
-	amute.nPortIndex = 100;
-	amute.bMute = mute ? OMX_TRUE : OMX_FALSE;
-
-// FIXME
-//	if (OMX_SetConfig(ILC_GET_HANDLE(m_comp[eAudioRender]),
-//			OMX_IndexConfigAudioMute, &amute) != OMX_ErrorNone)
-//		syslog(LOG_ERR, "[cOmx] failed to set mute state!");
-}
-
 void cOmx::StopVideo(void)
 {
 	Lock();
@@ -1427,6 +1419,22 @@ bool cOmx::EmptyAudioBuffer(OMX_BUFFERHEADERTYPE *buf)
 	return ret;
 }
 
+// returns an audio buffer which has been requested but not been filled
+void cOmx::ReturnAudioBuffer(OMX_BUFFERHEADERTYPE *buf)
+{
+	if (!buf)
+		return;
+
+	Lock();
+	if (buf->nFlags & OMX_BUFFERFLAG_STARTTIME)
+		m_setAudioStartTime = true;
+
+	buf->nFilledLen = 0;
+	buf->pAppPrivate = m_spareAudioBuffers;
+	m_spareAudioBuffers = buf;
+	Unlock();
+}
+
 bool cOmx::EmptyVideoBuffer(OMX_BUFFERHEADERTYPE *buf)
 {
 	if (!buf)
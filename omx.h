@@ -46,6 +46,12 @@ public:
 	void SetEndOfStreamCallback(void (*onEndOfStream)(void*), void* data);
 	void SetStreamStartCallback(void (*onStreamStart)(void*), void* data);
 
+	// called from IL client context whenever the audio render returned a
+	// buffer, so it must not block. Once cleared, the callback isn't running
+	// and won't be called anymore.
+	void SetAudioBufferEmptiedCallback(
+			void (*onAudioBufferEmptied)(void*), void* data);
+
 	static OMX_TICKS ToOmxTicks(int64_t val);
 	static int64_t FromOmxTicks(OMX_TICKS &ticks);
 	static void PtsToTicks(int64_t pts, OMX_TICKS &ticks);
@@ -79,8 +85,6 @@ public:
 
 	void SetClockReference(eClockReference clockReference);
 	void SetClockLatencyTarget(void);
-	void SetVolume(int vol);
-	void SetMute(bool mute);
 	void StopVideo(void);
 	void StopAudio(void);
 
@@ -110,6 +114,7 @@ public:
 	bool PollVideo(void);
 
 	bool EmptyAudioBuffer(OMX_BUFFERHEADERTYPE *buf);
+	void ReturnAudioBuffer(OMX_BUFFERHEADERTYPE *buf);
 	bool EmptyVideoBuffer(OMX_BUFFERHEADERTYPE *buf);
 
 	void GetBufferUsage(int &audio, int &video);
@@ -177,6 +182,10 @@ private:
 	void (*m_onStreamStart)(void*);
 	void *m_onStreamStartData;
 
+	void (*m_onAudioBufferEmptied)(void*);
+	void *m_onAudioBufferEmptiedData;
+	cMutex m_audioBufferEmptiedMutex;	// held while calling it
+
 	void HandlePortBufferEmptied(eOmxComponent component);
 	void HandlePortSettingsChanged(unsigned int portId);
 	void SetPARChangeCallback(bool enable);
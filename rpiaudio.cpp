@@ -18,872 +18,444 @@
  */
 
 #include "rpiaudio.h"
+#include "rpiaudioint.h"
+#include "rpiaudiodsp.h"
 #include "rpisetup.h"
 #include "omx.h"
 
 #include <syslog.h>
+#include <algorithm>
+#include <string.h>
+#include <sys/sysinfo.h>
+
+// number of recently used audio setups for which the render keeps the
+// selected output format, so switching back and forth between audio tracks
+// doesn't need to query the sink's capabilities again
+#define AUDIO_SETUP_CACHE_SIZE 4
+
+// number of initialized resampler contexts kept by the render, so switching
+// between streams of different formats doesn't need to set up new ones
+#define AUDIO_RESAMPLER_CACHE_SIZE 4
+
+// the resampler converts to planar float, which is converted to the render's
+// output together with applying volume, in chunks of the given samples
+#define AUDIO_RESAMPLE_SAMPLES 1024
+
+// decoded PCM frames are packed into the render's OMX buffers, which are
+// written when they can't take another frame, when the first frame has been
+// held for the given time in ms or when the stream is discontinuous by more
+// than the given tolerance in 90kHz ticks. A deadline of 0 writes every
+// frame in its own buffer.
+#define AUDIO_PACK_DEADLINE 50
+#define AUDIO_PACK_PTS_TOLERANCE (2 * 90)
+
+// volume and mute of decoded audio are applied by the render while converting
+// samples. To avoid clicks, gain changes are ramped over the given time in ms
+// in steps of the given number of samples.
+#define AUDIO_GAIN_RAMP 10
+#define AUDIO_GAIN_STEP 32
+
+// audio decoders are opened on first use. Unless they're opened in advance
+// (AUDIO_DECODER_PREWARM), decoders which haven't been used for the given
+// time in ms get released. Any idle decoder gets released if free memory
+// drops below the given limit, which is checked every few seconds.
+#define AVCODEC_IDLE_RELEASE (10 * 60 * 1000)
+#define AVCODEC_LOW_MEMORY (MEGABYTE(16))
+#define AVCODEC_MEMORY_CHECK (10 * 1000)
+
+// decoding load is measured over windows of the given amount of decoded audio
+// in us. Quality is reduced by one step after the configured load has been
+// exceeded in a number of consecutive windows, and restored by one step after
+// the load stayed below two thirds of it for the recovery number of windows.
+// If the load rises again within the relapse time in ms after restoring,
+// the recovery period is doubled up to the given maximum.
+#define AUDIO_LOAD_WINDOW (1000 * 1000)
+#define AUDIO_LOAD_OVERLOAD 3
+#define AUDIO_LOAD_RECOVERY 10
+#define AUDIO_LOAD_MAX_RECOVERY 160
+#define AUDIO_LOAD_RELAPSE (30 * 1000)
 
-extern "C" {
-#include <libavcodec/avcodec.h>
-#include <libavutil/log.h>
-#include <libavutil/opt.h>
-
-#ifdef ENABLE_AAC_LATM
-#warning "experimental AAC-LATM frame parser enabled, only 2ch/48kHz supported!"
-#endif
-
-// ffmpeg's resampling
-#ifdef HAVE_LIBSWRESAMPLE
-#  include <libswresample/swresample.h>
-#  define DO_RESAMPLE
-#endif
+///
+///	MPEG bit rate table.
+///
+///	BitRateTable[Version][Layer][Index]
+///
+const uint16_t cRpiAudioDecoder::cParser::BitRateTable[2][3][16] =
+{
+	{	// MPEG Version 1
+		{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0},
+		{0, 32, 48, 56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 384, 0},
+		{0, 32, 40, 48,  56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 0}
+	},
+	{	// MPEG Version 2 & 2.5
+		{0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0},
+		{0,  8, 16, 24, 32, 40, 48,  56,  64,  80,  96, 112, 128, 144, 160, 0},
+		{0,  8, 16, 24, 32, 40, 48,  56,  64,  80,  96, 112, 128, 144, 160, 0}
+	}
+};
 
-// libav's resampling
-#ifdef HAVE_LIBAVRESAMPLE
-#  include <libavresample/avresample.h>
-#  include <libavutil/samplefmt.h>
-#  define DO_RESAMPLE
-#  define SwrContext AVAudioResampleContext
-#  define swr_alloc  avresample_alloc_context
-#  define swr_init   avresample_open
-#  define swr_free   avresample_free
-#  define swr_convert(ctx, dst, out_cnt, src, in_cnt) \
-		avresample_convert(ctx, dst, 0, out_cnt, (uint8_t**)src, 0, in_cnt)
-#endif
+///
+///	MPEG sample rate table.
+///
+const uint16_t cRpiAudioDecoder::cParser::MpegSampleRateTable[4] =
+	{ 44100, 48000, 32000, 0 };
 
-// legacy libavcodec
-#if LIBAVCODEC_VERSION_MAJOR < 55
-#  define av_frame_alloc       avcodec_alloc_frame
-#  define av_frame_free        avcodec_free_frame
-#  define av_frame_unref       avcodec_get_frame_defaults
-#  define AV_CODEC_ID_MP3      CODEC_ID_MP3
-#  define AV_CODEC_ID_AC3      CODEC_ID_AC3
-#  define AV_CODEC_ID_EAC3     CODEC_ID_EAC3
-#  define AV_CODEC_ID_AAC      CODEC_ID_AAC
-#  define AV_CODEC_ID_AAC_LATM CODEC_ID_AAC_LATM
-#  define AV_CODEC_ID_DTS      CODEC_ID_DTS
-#endif
+///
+///	AC-3 sample rate table.
+///
+const uint16_t cRpiAudioDecoder::cParser::Ac3SampleRateTable[4] =
+	{ 48000, 44100, 32000, 0 };
 
-#if LIBAVCODEC_VERSION_MAJOR < 54
-#  define avcodec_free_frame av_free
-#endif
+///
+///	Possible AC-3 frame sizes.
+///
+///	from ATSC A/52 table 5.18 frame size code table.
+///
+const uint16_t cRpiAudioDecoder::cParser::Ac3FrameSizeTable[38][3] =
+{
+	{  64,   69,   96}, {  64,   70,   96}, {  80,   87,  120}, { 80,  88,  120},
+	{  96,  104,  144}, {  96,  105,  144}, { 112,  121,  168}, {112, 122,  168},
+	{ 128,  139,  192}, { 128,  140,  192}, { 160,  174,  240}, {160, 175,  240},
+	{ 192,  208,  288}, { 192,  209,  288}, { 224,  243,  336}, {224, 244,  336},
+	{ 256,  278,  384}, { 256,  279,  384}, { 320,  348,  480}, {320, 349,  480},
+	{ 384,  417,  576}, { 384,  418,  576}, { 448,  487,  672}, {448, 488,  672},
+	{ 512,  557,  768}, { 512,  558,  768}, { 640,  696,  960}, {640, 697,  960},
+	{ 768,  835, 1152}, { 768,  836, 1152}, { 896,  975, 1344}, {896, 976, 1344},
+	{1024, 1114, 1536}, {1024, 1115, 1536}, {1152, 1253, 1728},
+	{1152, 1254, 1728}, {1280, 1393, 1920}, {1280, 1394, 1920},
+};
 
-// prevent depreciated warnings for >ffmpeg-1.2.x and >libav-9.x
-#if LIBAVCODEC_VERSION_MAJOR > 54
-#  undef FF_API_REQUEST_CHANNELS
-#endif
-}
+///
+///	DTS sample rate table.
+///
+const uint32_t cRpiAudioDecoder::cParser::DtsSampleRateTable[16] =
+	{ 0,  8000, 16000, 32000, 64000,
+	  0, 11025, 22050, 44100, 88200,
+	  0, 12000, 24000, 48000, 96000, 0 };
 
-#include <queue>
-#include <string.h>
+/* ------------------------------------------------------------------------- */
 
-#define AVPKT_BUFFER_SIZE (KILOBYTE(256))
+// Queue of decoded audio frames waiting to be written to the render, so the
+// decoder can run ahead and absorb jitter of both decoding and OMX buffer
+// availability. Frames are decoded directly into the slot at the back.
+// Single producer, single consumer, so the render may run in its own thread.
 
-class cRpiAudioDecoder::cParser
+class cRpiAudioDecoder::cFrameQueue
 {
 
 public:
 
-	cParser() :
-		m_mutex(new cMutex()),
-		m_codec(cAudioCodec::eInvalid),
-		m_channels(0),
-		m_samplingRate(0),
-		m_size(0),
-		m_parsed(true)
+	cFrameQueue() :
+		m_read(0),
+		m_write(0),
+		m_duration(0),
+		m_maxDuration(0),
+		m_decoded(0)
 	{
+		memset(m_frames, 0, sizeof(m_frames));
 	}
 
-	~cParser()
+	int Init(void)
 	{
-		delete m_mutex;
+		for (unsigned int i = 0; i < AVFRAME_QUEUE_SIZE; i++)
+		{
+			m_frames[i] = av_frame_alloc();
+			if (!m_frames[i])
+			{
+				DeInit();
+				return -1;
+			}
+		}
+		m_read = 0;
+		m_write = 0;
+		m_duration = 0;
+		m_decoded = 0;
+		return 0;
 	}
 
-	AVPacket* Packet(void)
+	void DeInit(void)
 	{
-		return &m_packet;
+		for (unsigned int i = 0; i < AVFRAME_QUEUE_SIZE; i++)
+			if (m_frames[i])
+				av_frame_free(&m_frames[i]);
 	}
 
-	cAudioCodec::eCodec GetCodec(void)
+	void SetMaxDuration(unsigned int ms)
 	{
-		if (!m_parsed)
-			Parse();
-		return m_codec;
+		m_maxDuration = ms * 1000;
 	}
 
-	unsigned int GetChannels(void)
+	bool IsEmpty(void)
 	{
-		if (!m_parsed)
-			Parse();
-		return m_channels;
+		return ReadIndex() == WriteIndex();
 	}
 
-	unsigned int GetSamplingRate(void)
+	// at least one frame can always be queued
+	bool IsFull(void)
 	{
-		if (!m_parsed)
-			Parse();
-		return m_samplingRate;
+		unsigned int queued = WriteIndex() - ReadIndex();
+		return queued == AVFRAME_QUEUE_SIZE || (queued &&
+				__atomic_load_n(&m_duration, __ATOMIC_RELAXED) >= m_maxDuration);
 	}
 
-	unsigned int GetFrameSize(void)
+	// number of frames pushed and popped so far, used to detect progress
+	unsigned int ReadIndex(void)
 	{
-		if (!m_parsed)
-			Parse();
-		return m_packet.size;
+		return __atomic_load_n(&m_read, __ATOMIC_ACQUIRE);
 	}
 
-	int64_t GetPts(void)
+	unsigned int WriteIndex(void)
 	{
-		int64_t pts = OMX_INVALID_PTS;
-		m_mutex->Lock();
-
-		if (!m_ptsQueue.empty())
-			pts = m_ptsQueue.front()->pts;
-
-		m_mutex->Unlock();
-		return pts;
+		return __atomic_load_n(&m_write, __ATOMIC_ACQUIRE);
 	}
 
-	unsigned int GetFreeSpace(void)
+	AVFrame* Front(void)
 	{
-		return AVPKT_BUFFER_SIZE - m_size - AV_INPUT_BUFFER_PADDING_SIZE;
+		return m_frames[m_read % AVFRAME_QUEUE_SIZE];
 	}
 
-	bool Empty(void)
+	AVFrame* Back(void)
 	{
-		if (!m_parsed)
-			Parse();
-		return m_packet.size == 0;
+		return m_frames[m_write % AVFRAME_QUEUE_SIZE];
 	}
 
-	int Init(void)
+	// codec and time in us a frame has been queued, for statistics
+	cAudioCodec::eCodec FrontCodec(void)
 	{
-		if (!av_new_packet(&m_packet, AVPKT_BUFFER_SIZE))
-		{
-			Reset();
-			return 0;
-		}
-		return -1;
+		return m_codec[m_read % AVFRAME_QUEUE_SIZE];
 	}
 
-	int DeInit(void)
+	uint64_t FrontTime(void)
 	{
-		av_free_packet(&m_packet);
-		return 0;
+		return m_time[m_read % AVFRAME_QUEUE_SIZE];
 	}
 
-	void Reset(void)
+	// total duration of all frames pushed in us, only used by producer
+	uint64_t GetDecodedDuration(void)
 	{
-		m_mutex->Lock();
-		m_codec = cAudioCodec::eInvalid;
-		m_channels = 0;
-		m_samplingRate = 0;
-		m_packet.size = 0;
-		m_size = 0;
-		m_parsed = true; // parser is empty, no need for parsing
-		memset(m_packet.data, 0, AV_INPUT_BUFFER_PADDING_SIZE);
-
-		while (!m_ptsQueue.empty())
-		{
-			delete m_ptsQueue.front();
-			m_ptsQueue.pop();
-		}
-		m_mutex->Unlock();
+		return m_decoded;
 	}
 
-	bool Append(const unsigned char *data, int64_t pts, unsigned int length)
+	void Push(cAudioCodec::eCodec codec)
 	{
-		m_mutex->Lock();
-		bool ret = true;
-
-		if (m_size + length + AV_INPUT_BUFFER_PADDING_SIZE > AVPKT_BUFFER_SIZE)
-			ret = false;
-		else
-		{
-			memcpy(m_packet.data + m_size, data, length);
-			m_size += length;
-			memset(m_packet.data + m_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
-
-			Pts* entry = new Pts(pts, length);
-			m_ptsQueue.push(entry);
-
-			m_parsed = false;
-		}
-		m_mutex->Unlock();
-		return ret;
+		unsigned int duration = Duration(Back());
+		m_codec[m_write % AVFRAME_QUEUE_SIZE] = codec;
+		m_time[m_write % AVFRAME_QUEUE_SIZE] = NowUs();
+		m_decoded += duration;
+		__atomic_add_fetch(&m_duration, duration, __ATOMIC_RELAXED);
+		__atomic_store_n(&m_write, m_write + 1, __ATOMIC_RELEASE);
 	}
 
-	void Shrink(unsigned int length, bool retainPts = false)
+	void Pop(void)
 	{
-		m_mutex->Lock();
-
-		if (length < m_size)
-		{
-			memmove(m_packet.data, m_packet.data + length, m_size - length);
-			m_size -= length;
-			memset(m_packet.data + m_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
-
-			while (!m_ptsQueue.empty() && length)
-			{
-				if (m_ptsQueue.front()->length <= length)
-				{
-					length -= m_ptsQueue.front()->length;
-					delete m_ptsQueue.front();
-					m_ptsQueue.pop();
-				}
-				else
-				{
-					// clear current PTS since it's not valid anymore after
-					// shrinking the packet
-					if (!retainPts)
-						m_ptsQueue.front()->pts = OMX_INVALID_PTS;
-
-					m_ptsQueue.front()->length -= length;
-					length = 0;
-				}
-			}
-
-			m_parsed = false;
-		}
-		else
-			Reset();
-
-		m_mutex->Unlock();
+		__atomic_sub_fetch(&m_duration, Duration(Front()), __ATOMIC_RELAXED);
+		av_frame_unref(Front());
+		__atomic_store_n(&m_read, m_read + 1, __ATOMIC_RELEASE);
 	}
-	
-private:
-
-	cParser(const cParser&);
-	cParser& operator= (const cParser&);
-
-	// Check format of first audio packet in buffer. If format has been
-	// guessed, but packet is not yet complete, codec is set with a length
-	// of 0. Once the buffer contains either the exact amount of expected
-	// data or another valid packet start after the first frame, packet
-	// size is set to the first frame length.
-	// Valid packets are always moved to the buffer start, if no valid
-	// audio frame has been found, packet gets cleared.
 
-	void Parse()
+	void Clear(void)
 	{
-		m_mutex->Lock();
-
-		cAudioCodec::eCodec codec = cAudioCodec::eInvalid;
-		unsigned int channels = 0;
-		unsigned int offset = 0;
-		unsigned int frameSize = 0;
-		unsigned int samplingRate = 0;
-
-		while (m_size - offset >= 4)
-		{
-			// 0xFFE...      MPEG audio
-			// 0x0B77...     (E)AC-3 audio
-			// 0xFFF...      AAC audio
-			// 0x7FFE8001... DTS audio
-			// PCM audio can't be found
-
-			const uint8_t *p = m_packet.data + offset;
-			unsigned int n = m_size - offset;
-
-			switch (FastCheck(p))
-			{
-			case cAudioCodec::eMPG:
-				if (MpegCheck(p, n, frameSize, channels, samplingRate))
-					codec = cAudioCodec::eMPG;
-				break;
-
-			case cAudioCodec::eAC3:
-				if (Ac3Check(p, n, frameSize, channels, samplingRate))
-				{
-					codec = cAudioCodec::eAC3;
-					if (n > 5 && p[5] > (10 << 3))
-						codec = cAudioCodec::eEAC3;
-				}
-				break;
-
-			case cAudioCodec::eAAC:
-				if (AdtsCheck(p, n, frameSize, channels, samplingRate))
-					codec = cAudioCodec::eAAC;
-				break;
-
-#ifdef ENABLE_AAC_LATM
-			case cAudioCodec::eAAC_LATM:
-				if (LatmCheck(p, n, frameSize, channels, samplingRate))
-					codec = cAudioCodec::eAAC_LATM;
-				break;
-#endif
-
-			case cAudioCodec::eDTS:
-				if (DtsCheck(p, n, frameSize, channels, samplingRate))
-					codec = cAudioCodec::eDTS;
-				break;
-
-			default:
-				break;
-			}
-
-			if (codec != cAudioCodec::eInvalid)
-			{
-				// if there is enough data in buffer, check if predicted next
-				// frame start is valid
-				if (n < frameSize + 4 ||
-						FastCheck(p + frameSize) != cAudioCodec::eInvalid)
-				{
-					// if codec has been detected but buffer does not yet
-					// contains a complete frame, set size to zero to prevent
-					// frame from being decoded
-					if (frameSize > n)
-						frameSize = 0;
-
-					break;
-				}
-			}
-
-			++offset;
-		}
-
-		if (offset)
-		{
-			syslog(LOG_DEBUG, "[cRpiAudioDecoder] audio parser skipped %u of %u bytes", offset, m_size);
-			Shrink(offset, true);
-		}
-
-		if (codec != cAudioCodec::eInvalid)
-		{
-			m_codec = codec;
-			m_channels = channels;
-			m_samplingRate = samplingRate;
-			m_packet.size = frameSize;
-		}
-		else
-			m_packet.size = 0;
-
-		m_parsed = true;
-		m_mutex->Unlock();
+		while (!IsEmpty())
+			Pop();
 	}
 
-	struct Pts
-	{
-		Pts(int64_t _pts, unsigned int _length)
-			: pts(_pts), length(_length) { };
-
-		int64_t 		pts;
-		unsigned int 	length;
-	};
+private:
 
-	cMutex*				m_mutex;
-	AVPacket 			m_packet;
-	cAudioCodec::eCodec m_codec;
-	unsigned int		m_channels;
-	unsigned int		m_samplingRate;
-	unsigned int		m_size;
-	std::queue<Pts*> 	m_ptsQueue;
-	bool				m_parsed;
-
-	/* ---------------------------------------------------------------------- */
-	/*     audio codec parser helper functions, based on e2-rpihddevice       */
-	/* ---------------------------------------------------------------------- */
-
-	static const uint16_t BitRateTable[2][3][16];
-	static const uint16_t MpegSampleRateTable[4];
-	static const uint32_t Mpeg4SampleRateTable[16];
-	static const uint16_t Ac3SampleRateTable[4];
-	static const uint16_t Ac3FrameSizeTable[38][3];
-	static const uint32_t DtsSampleRateTable[16];
-
-	static cAudioCodec::eCodec FastCheck(const uint8_t *p)
-	{
-		return 	FastMpegCheck(p)  ? cAudioCodec::eMPG      :
-				FastAc3Check (p)  ? cAudioCodec::eAC3      :
-				FastAdtsCheck(p)  ? cAudioCodec::eAAC      :
-#ifdef ENABLE_AAC_LATM
-				FastLatmCheck(p)  ? cAudioCodec::eAAC_LATM :
-#endif
-				FastDtsCheck (p)  ? cAudioCodec::eDTS      :
-									cAudioCodec::eInvalid;
-	}
+	cFrameQueue(const cFrameQueue&);
+	cFrameQueue& operator= (const cFrameQueue&);
 
-	///
-	///	Fast check for MPEG audio.
-	///
-	///	0xFFE... MPEG audio
-	///
-	static bool FastMpegCheck(const uint8_t *p)
+	// duration in us
+	static unsigned int Duration(AVFrame *frame)
 	{
-		if (p[0] != 0xFF)			// 11bit frame sync
-			return false;
-		if ((p[1] & 0xE0) != 0xE0)
-			return false;
-		if ((p[1] & 0x18) == 0x08)	// version ID - 01 reserved
-			return false;
-		if (!(p[1] & 0x06))			// layer description - 00 reserved
-			return false;
-		if ((p[2] & 0xF0) == 0xF0)	// bit rate index - 1111 reserved
-			return false;
-		if ((p[2] & 0x0C) == 0x0C)	// sampling rate index - 11 reserved
-			return false;
-		return true;
+		return frame->sample_rate ?
+				(uint64_t)frame->nb_samples * 1000000 / frame->sample_rate : 0;
 	}
 
-	///	Check for MPEG audio.
-	///
-	///	0xFFEx already checked.
-	///
-	///	From: http://www.mpgedit.org/mpgedit/mpeg_format/mpeghdr.htm
-	///
-	///	AAAAAAAA AAABBCCD EEEEFFGH IIJJKLMM
-	///
-	///	o a 11x Frame sync
-	///	o b 2x	MPEG audio version (2.5, reserved, 2, 1)
-	///	o c 2x	Layer (reserved, III, II, I)
-	///	o e 2x	BitRate index
-	///	o f 2x	SampleRate index (41000, 48000, 32000, 0)
-	///	o g 1x	Padding bit
-	/// o h 1x  Private bit
-	/// o i 2x  Channel mode
-	///	o ..	Doesn't care
-	///
-	///	frame length:
-	///	Layer I:
-	///		FrameLengthInBytes = (12 * BitRate / SampleRate + Padding) * 4
-	///	Layer II & III:
-	///		FrameLengthInBytes = 144 * BitRate / SampleRate + Padding
-	///
-	static bool MpegCheck(const uint8_t *p, unsigned int size,
-			unsigned int &frameSize, unsigned int &channels,
-			unsigned int &samplingRate)
-	{
-		frameSize = size;
-		if (size < 4)
-			return true;
-
-		int cmode = (p[3] >> 6) & 0x03;
-		int mpeg2 = !(p[1] & 0x08) && (p[1] & 0x10);
-		int mpeg25 = !(p[1] & 0x08) && !(p[1] & 0x10);
-		int layer = 4 - ((p[1] >> 1) & 0x03);
-		int padding = (p[2] >> 1) & 0x01;
+	AVFrame		   *m_frames[AVFRAME_QUEUE_SIZE];
+	cAudioCodec::eCodec m_codec[AVFRAME_QUEUE_SIZE];
+	uint64_t		m_time[AVFRAME_QUEUE_SIZE];
+	unsigned int	m_read;
+	unsigned int	m_write;
+	unsigned int	m_duration;
+	unsigned int	m_maxDuration;
+	uint64_t		m_decoded;
+};
 
-		// channel mode = [ stereo, joint stereo, dual channel, mono]
-		channels = cmode == 0x03 ? 1 : 2;
+/* ------------------------------------------------------------------------- */
 
-		samplingRate = MpegSampleRateTable[(p[2] >> 2) & 0x03];
-		if (!samplingRate)
-			return false;
+// Packer of compressed audio frames into IEC 61937 data bursts, which are
+// transmitted like 16 bit stereo PCM at the sampling rate of the stream, or
+// at four times of it for E-AC-3. A burst starts with the preamble words Pa
+// and Pb (sync), Pc (data type) and Pd (payload length), followed by the
+// frame in 16 bit little endian words and zeros up to the repetition period
+// of the data type (IEC 61937-1, 6.1; IEC 61937-3, -5). E-AC-3 frames of less
+// than six audio blocks are collected until the burst's 1536 samples are
+// complete. DTS is supported without extensions and with 512, 1024 or 2048
+// samples per frame.
+
+class cRpiIec61937Packer
+{
 
-		samplingRate >>= mpeg2;		// MPEG 2 half rate
-		samplingRate >>= mpeg25;	// MPEG 2.5 quarter rate
+public:
 
-		int bit_rate =
-				BitRateTable[mpeg2 | mpeg25][layer - 1][(p[2] >> 4) & 0x0F];
-		if (!bit_rate)
-			return false;
+	cRpiIec61937Packer() :
+		m_size(0),
+		m_frames(0)
+	{
+	}
 
-		switch (layer)
+	// true if the given stream can be packed
+	static bool IsSupported(cAudioCodec::eCodec codec,
+			unsigned int samplingRate, bool extensions)
+	{
+		switch (codec)
 		{
-		case 1:
-			frameSize = (12000 * bit_rate) / samplingRate;
-			frameSize = (frameSize + padding) * 4;
-			break;
-		case 2:
-		case 3:
+		case cAudioCodec::eAC3:
+			return true;
+		case cAudioCodec::eEAC3:
+			return samplingRate * GetRateFactor(codec) <= 192000;
+		case cAudioCodec::eDTS:
+			return !extensions;
 		default:
-			frameSize = (144000 * bit_rate) / samplingRate;
-			frameSize = frameSize + padding;
-			break;
+			return false;
 		}
-		return true;
 	}
 
-	///
-	///	Fast check for (E-)AC-3 audio.
-	///
-	///	0x0B77... AC-3 audio
-	///
-	static bool FastAc3Check(const uint8_t *p)
+	// factor of the PCM sampling rate bursts are sent with to the one of
+	// the stream
+	static unsigned int GetRateFactor(cAudioCodec::eCodec codec)
 	{
-		if (p[0] != 0x0B)			// 16bit sync
-			return false;
-		if (p[1] != 0x77)
-			return false;
-		return true;
+		return codec == cAudioCodec::eEAC3 ? 4 : 1;
 	}
 
-	///
-	///	Check for (E-)AC-3 audio.
-	///
-	///	0x0B77xxxxxx already checked.
-	///
-	///	o AC-3 Header
-	///	AAAAAAAA AAAAAAAA BBBBBBBB BBBBBBBB CCDDDDDD EEEEEFFF GGGxxxxx
-	///
-	///	o a 16x Frame sync, always 0x0B77
-	///	o b 16x CRC 16
-	///	o c 2x	Sample rate ( 48000, 44100, 32000, reserved )
-	///	o d 6x	Frame size code
-	///	o e 5x	Bit stream ID
-	///	o f 3x	Bit stream mode
-	/// o g 3x  Audio coding mode
-	///
-	///	o E-AC-3 Header
-	///	AAAAAAAA AAAAAAAA BBCCCDDD DDDDDDDD EEFFGGGH IIIII...
-	///
-	///	o a 16x Frame sync, always 0x0B77
-	///	o b 2x	Frame type
-	///	o c 3x	Sub stream ID
-	///	o d 11x Frame size - 1 in words
-	///	o e 2x	Frame size code
-	///	o f 2x	Frame size code 2
-	/// o g 3x  Channel mode
-	/// 0 h 1x  LFE on
-	///
-	static bool Ac3Check(const uint8_t *p, unsigned int size,
-			unsigned int &frameSize, unsigned int &channels,
-			unsigned int &samplingRate)
-	{
-		frameSize = size;
-		if (size < 7)
-			return true;
+	// Adds a frame of the given codec to the next burst. Returns the size of
+	// the burst in bytes once it's complete, 0 if further frames are needed
+	// to complete it or -1 if the frame can't be packed.
 
-		int acmod;
-		bool lfe;
-		int fscod = (p[4] & 0xC0) >> 6;
+	int Pack(cAudioCodec::eCodec codec, const uint8_t *p, unsigned int n)
+	{
+		unsigned int type = 0, period = 0, frames = 1;
+		switch (codec)
+		{
+		case cAudioCodec::eAC3:
+			// bit stream mode in Pc bits 8..10
+			type = eAc3 | (p[5] & 0x07) << 8;
+			period = 1536 * 4;
+			break;
 
-		samplingRate = Ac3SampleRateTable[fscod];
+		case cAudioCodec::eEAC3:
+			// Access units may start with an AC-3 frame (bsid <= 10) followed
+			// by E-AC-3 substreams, which always has 6 audio blocks, as well
+			// as E-AC-3 frames using fscod2.
+			type = eEac3;
+			period = 1536 * 4 * 4;
+			if ((p[5] >> 3) > 10 && (p[4] & 0xc0) != 0xc0)
+				frames = 6 / Eac3Blocks[(p[4] >> 4) & 0x03];
+			break;
 
-		if (p[5] > (10 << 3))		// E-AC-3
+		case cAudioCodec::eDTS:
 		{
-			if (fscod == 0x03)
-			{
-				int fscod2 = (p[4] & 0x30) >> 4;
-				if (fscod2 == 0x03)
-					return false;		// invalid fscod & fscod2
+			unsigned int samples = ((p[4] & 0x01) << 6 | p[5] >> 2) + 1;
+			type = samples == 16 ? eDts512 : samples == 32 ? eDts1024 :
+					samples == 64 ? eDts2048 : 0;
+			period = samples * 32 * 4;
+			break;
+		}
 
-				samplingRate = Ac3SampleRateTable[fscod2] / 2;
-			}
+		default:
+			break;
+		}
 
-			acmod = (p[4] & 0x0E) >> 1;	// number of channels, LFE excluded
-			lfe = p[4] & 0x01;
+		if (!type || eHeaderSize + m_size + ((n + 1) & ~1) > period)
+		{
+			Reset();
+			return -1;
+		}
 
-			frameSize = ((p[2] & 0x07) << 8) + p[3] + 1;
-			frameSize *= 2;
+		// payload as 16 bit words in little endian order, padded to words
+		uint8_t *dst = m_burst + eHeaderSize + m_size;
+		for (unsigned int i = 0; i + 1 < n; i += 2)
+		{
+			dst[i] = p[i + 1];
+			dst[i + 1] = p[i];
 		}
-		else						// AC-3
+		if (n & 1)
 		{
-			if (fscod == 0x03)		// invalid sample rate
-				return false;
-
-			int frmsizcod = p[4] & 0x3F;
-			if (frmsizcod > 37)		// invalid frame size
-				return false;
-
-			acmod = p[6] >> 5;		// number of channels, LFE excluded
+			dst[n - 1] = 0;
+			dst[n] = p[n - 1];
+		}
+		m_size += (n + 1) & ~1;
 
-			int lfe_bptr = 51;		// position of LFE bit in header for 2.0
-			if ((acmod & 0x01) && (acmod != 0x01))
-				lfe_bptr += 2;		// skip center mix level
-			if (acmod & 0x04)
-				lfe_bptr += 2;		// skip surround mix level
-			if (acmod == 0x02)
-				lfe_bptr += 2;		// skip surround mode
-			lfe = (p[lfe_bptr / 8] & (1 << (7 - (lfe_bptr % 8))));
+		if (++m_frames < frames)
+			return 0;
 
-			// invalid is checked above
-			frameSize = Ac3FrameSizeTable[frmsizcod][fscod] * 2;
+		// length in bytes for E-AC-3, in bits for others
+		unsigned int length = codec == cAudioCodec::eEAC3 ? m_size : m_size * 8;
+		uint16_t preamble[] = {
+			eSyncPa, eSyncPb, (uint16_t)type, (uint16_t)length
+		};
+		for (unsigned int i = 0; i < 4; i++)
+		{
+			m_burst[2 * i] = preamble[i] & 0xff;
+			m_burst[2 * i + 1] = preamble[i] >> 8;
 		}
+		memset(m_burst + eHeaderSize + m_size, 0, period - eHeaderSize - m_size);
 
-		channels =
-			acmod == 0x00 ? 2 : 	// Ch1, Ch2
-			acmod == 0x01 ? 1 : 	// C
-			acmod == 0x02 ? 2 : 	// L, R
-			acmod == 0x03 ? 3 : 	// L, C, R
-			acmod == 0x04 ? 3 : 	// L, R, S
-			acmod == 0x05 ? 4 : 	// L, C, R, S
-			acmod == 0x06 ? 4 : 	// L, R, RL, RR
-			acmod == 0x07 ? 5 : 0;	// L, C, R, RL, RR
-
-		if (lfe) channels++;
-		return true;
+		Reset();
+		return period;
 	}
 
-#ifdef ENABLE_AAC_LATM
-	///
-	///	Fast check for AAC LATM audio.
-	///
-	///	0x56E... AAC LATM audio
-	///
-	static bool FastLatmCheck(const uint8_t *p)
+	// burst completed by last call of Pack()
+	const uint8_t* GetBurst(void)
 	{
-		if (p[0] != 0x56)			// 11bit sync
-			return false;
-		if ((p[1] & 0xE0) != 0xE0)
-			return false;
-		return true;
+		return m_burst;
 	}
 
-	///
-	///	Check for AAC LATM audio.
-	///
-	///	0x56Exxx already checked.
-	///
-	static bool LatmCheck(const uint8_t *p, unsigned int size,
-			unsigned int &frameSize, unsigned int &channels,
-			unsigned int &samplingRate)
+	// true if no frames have been collected for the next burst
+	bool IsEmpty(void)
 	{
-		frameSize = size;
-		if (size < 3)
-			return true;
-
-		// to do: determine channels
-		channels = 2;
-
-		// to do: determine sampling rate
-		samplingRate = 48000;
-
-		// 13 bit frame size without header
-		frameSize = ((p[1] & 0x1F) << 8) + p[2];
-		frameSize += 3;
-		return true;
-	}
-#endif
-	
-	///
-	///	Fast check for ADTS Audio Data Transport Stream.
-	///
-	///	0xFFF...  ADTS audio
-	///
-	static bool FastAdtsCheck(const uint8_t *p)
-	{
-		if (p[0] != 0xFF)			// 12bit sync
-			return false;
-		if ((p[1] & 0xF6) != 0xF0)	// sync + layer must be 0
-			return false;
-		if ((p[2] & 0x3C) == 0x3C)	// sampling frequency index != 15
-			return false;
-		return true;
-	}
-
-	///
-	///	Check for ADTS Audio Data Transport Stream.
-	///
-	///	0xFFF already checked.
-	///
-	///	AAAAAAAA AAAABCCD EEFFFFGH HHIJKLMM MMMMMMMM MMMOOOOO OOOOOOPP
-	///	(QQQQQQQQ QQQQQQQ)
-	///
-	///	o A*12	sync word 0xFFF
-	///	o B*1	MPEG Version: 0 for MPEG-4, 1 for MPEG-2
-	///	o C*2	layer: always 0
-	///	o ..
-	///	o F*4	sampling frequency index (15 is invalid)
-	///	o ..
-	/// o H*3	MPEG-4 channel configuration
-	/// o ...
-	///	o M*13	frame length
-	///
-	static bool AdtsCheck(const uint8_t *p, unsigned int size,
-			unsigned int &frameSize, unsigned int &channels,
-			unsigned int &samplingRate)
-	{
-		frameSize = size;
-		if (size < 6)
-			return true;
-
-		samplingRate = Mpeg4SampleRateTable[(p[2] >> 2) & 0x0F];
-
-		frameSize = (p[3] & 0x03) << 11;
-		frameSize |= (p[4] & 0xFF) << 3;
-		frameSize |= (p[5] & 0xE0) >> 5;
-
-	    int cConf = (p[2] & 0x01) << 7;
-	    cConf |= (p[3] & 0xC0) >> 6;
-	    channels =
-	    	cConf == 0x00 ? 0 : // defined in AOT specific config
-			cConf == 0x01 ? 1 : // C
-	    	cConf == 0x02 ? 2 : // L, R
-	    	cConf == 0x03 ? 3 : // C, L, R
-	    	cConf == 0x04 ? 4 : // C, L, R, RC
-	    	cConf == 0x05 ? 5 : // C, L, R, RL, RR
-	    	cConf == 0x06 ? 6 : // C, L, R, RL, RR, LFE
-	    	cConf == 0x07 ? 8 : // C, L, R, SL, SR, RL, RR, LFE
-				0;
-
-		if (!samplingRate || !channels)
-			return false;
-
-	    return true;
+		return !m_frames;
 	}
 
-	///
-	///	Fast check for DTS Audio Data Transport Stream.
-	///
-	///	0x7FFE8001....  DTS audio
-	///
-	static bool FastDtsCheck(const uint8_t *p)
+	void Reset(void)
 	{
-		if (p[0] != 0x7F)			// 32bit sync
-			return false;
-		if (p[1] != 0xFE)
-			return false;
-		if (p[2] != 0x80)
-			return false;
-		if (p[3] != 0x01)
-			return false;
-		return true;
+		m_size = 0;
+		m_frames = 0;
 	}
 
-	///
-	///	Check for DTS Audio Data Transport Stream.
-	///
-	///	0x7FFE8001 already checked.
-	///
-	///	AAAAAAAA AAAAAAAA AAAAAAAA AAAAAAAA BCCCCCDE EEEEEEFF FFFFFFFF FFFFGGGG
-	/// GGHHHHII IIIJKLMN OOOPQRRS TTTTTTTT TTTTTTTT UVVVVWWX XXYZaaaa
-	///
-	///	o A*32	sync word 0x7FFE8001
-	///	o B*1   frame type
-	///	o C*5   deficit sample count
-	///	o D*1   CRC present flag
-	///	o E*7   number of PCM sample blocks
-	///	o F*14  primary frame size
-	///	o G*6   audio channel arrangement
-	///	o H*4   core audio sampling frequency
-	///	o I*5   transmission bit rate
-	///	o J*1   embedded downmix enabled
-	///	o K*1   embedded dynamic range flag
-	///	o L*1   embedded time stamp flag
-	///	o M*1   auxiliary data flag
-	///	o N*1   HDCD
-	///	o O*3   extension audio descriptor flag
-	///	o P*1   extended coding flag
-	///	o Q*1   audio sync word insertion flag
-	///	o R*2   low frequency effects flag
-	///	o S*1   predictor history flag
-	///	o T*16  header CRC check (if CRC present flag set)
-	///	o U*1   multi rate interpolator switch
-	///	o V*4   encoder software revision
-	///	o W*2   copy history
-	///	o X*3   source PCM resolution
-	///	o Y*1   front sum/difference flag
-	///	o Z*1   surrounds sum/difference flag
-	///	o a*4   dialog normalization parameter
-	///
-	static bool DtsCheck(const uint8_t *p, unsigned int size,
-			unsigned int &frameSize, unsigned int &channels,
-			unsigned int &samplingRate)
-	{
-		frameSize = size;
-		if (size < 11)
-			return true;
+private:
 
-		frameSize = ((p[5] & 0x03) << 12) + (p[6] << 4) + ((p[7] & 0xF0) >> 4);
-		frameSize++;
+	cRpiIec61937Packer(const cRpiIec61937Packer&);
+	cRpiIec61937Packer& operator= (const cRpiIec61937Packer&);
 
-		samplingRate = DtsSampleRateTable[(p[8] & 0x3C) >> 2];
+	enum {
+		eSyncPa       = 0xF872,
+		eSyncPb       = 0x4E1F,
+		eHeaderSize   = 8,
+		eMaxBurstSize = 1536 * 4 * 4
+	};
 
-		int amode = ((p[7] & 0x0F) << 2) + ((p[8] & 0xC0) >> 6);
-		channels =
-			amode == 0x00 ? 1 : 	// mono
-			amode == 0x02 ? 2 : 	// L, R
-			amode == 0x03 ? 2 : 	// (L + R), (L - R)
-			amode == 0x04 ? 2 : 	// LT, RT
-			amode == 0x05 ? 3 : 	// L, R, C
-			amode == 0x06 ? 3 : 	// L, R, S
-			amode == 0x08 ? 4 : 	// L, R, RL, RR
-			amode == 0x09 ? 5 : 0;	// L, C, R, RL, RR
+	// data types of Pc (IEC 61937-2, table 2)
+	enum {
+		eAc3     = 1,
+		eDts512  = 11,
+		eDts1024 = 12,
+		eDts2048 = 13,
+		eEac3    = 21
+	};
 
-		if (!samplingRate || !channels)
-			return false;
+	static const uint8_t Eac3Blocks[4];
 
-		if (p[10] & 0x06) channels++;
-		return true;
-	}
-};
-
-///
-///	MPEG bit rate table.
-///
-///	BitRateTable[Version][Layer][Index]
-///
-const uint16_t cRpiAudioDecoder::cParser::BitRateTable[2][3][16] =
-{
-	{	// MPEG Version 1
-		{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0},
-		{0, 32, 48, 56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 384, 0},
-		{0, 32, 40, 48,  56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 0}
-	},
-	{	// MPEG Version 2 & 2.5
-		{0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0},
-		{0,  8, 16, 24, 32, 40, 48,  56,  64,  80,  96, 112, 128, 144, 160, 0},
-		{0,  8, 16, 24, 32, 40, 48,  56,  64,  80,  96, 112, 128, 144, 160, 0}
-	}
-};
-
-///
-///	MPEG sample rate table.
-///
-const uint16_t cRpiAudioDecoder::cParser::MpegSampleRateTable[4] =
-	{ 44100, 48000, 32000, 0 };
-
-///
-///	MPEG-4 sample rate table.
-///
-const uint32_t cRpiAudioDecoder::cParser::Mpeg4SampleRateTable[16] = {
-		96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
-		16000, 12000, 11025,  8000,  7350,     0,     0,     0
-};
-
-///
-///	AC-3 sample rate table.
-///
-const uint16_t cRpiAudioDecoder::cParser::Ac3SampleRateTable[4] =
-	{ 48000, 44100, 32000, 0 };
-
-///
-///	Possible AC-3 frame sizes.
-///
-///	from ATSC A/52 table 5.18 frame size code table.
-///
-const uint16_t cRpiAudioDecoder::cParser::Ac3FrameSizeTable[38][3] =
-{
-	{  64,   69,   96}, {  64,   70,   96}, {  80,   87,  120}, { 80,  88,  120},
-	{  96,  104,  144}, {  96,  105,  144}, { 112,  121,  168}, {112, 122,  168},
-	{ 128,  139,  192}, { 128,  140,  192}, { 160,  174,  240}, {160, 175,  240},
-	{ 192,  208,  288}, { 192,  209,  288}, { 224,  243,  336}, {224, 244,  336},
-	{ 256,  278,  384}, { 256,  279,  384}, { 320,  348,  480}, {320, 349,  480},
-	{ 384,  417,  576}, { 384,  418,  576}, { 448,  487,  672}, {448, 488,  672},
-	{ 512,  557,  768}, { 512,  558,  768}, { 640,  696,  960}, {640, 697,  960},
-	{ 768,  835, 1152}, { 768,  836, 1152}, { 896,  975, 1344}, {896, 976, 1344},
-	{1024, 1114, 1536}, {1024, 1115, 1536}, {1152, 1253, 1728},
-	{1152, 1254, 1728}, {1280, 1393, 1920}, {1280, 1394, 1920},
+	uint8_t      m_burst[eMaxBurstSize];
+	unsigned int m_size;	// payload of the next burst
+	unsigned int m_frames;	// frames collected for the next burst
 };
 
 ///
-///	DTS sample rate table.
+///	E-AC-3 number of audio blocks per frame, from numblkscod.
 ///
-const uint32_t cRpiAudioDecoder::cParser::DtsSampleRateTable[16] =
-	{ 0,  8000, 16000, 32000, 64000,
-	  0, 11025, 22050, 44100, 88200,
-	  0, 12000, 24000, 48000, 96000, 0 };
-
-/* ------------------------------------------------------------------------- */
-
-#define AV_CH_LAYOUT(ch) ( \
-		ch == 1 ? AV_CH_LAYOUT_MONO    : \
-		ch == 2 ? AV_CH_LAYOUT_STEREO  : \
-		ch == 3 ? AV_CH_LAYOUT_2POINT1 : \
-		ch == 6 ? AV_CH_LAYOUT_5POINT1 : 0)
-
-#define AV_SAMPLE_STR(fmt) ( \
-		fmt == AV_SAMPLE_FMT_U8   ? "U8"             : \
-		fmt == AV_SAMPLE_FMT_S16  ? "S16"            : \
-		fmt == AV_SAMPLE_FMT_S32  ? "S32"            : \
-		fmt == AV_SAMPLE_FMT_FLT  ? "float"          : \
-		fmt == AV_SAMPLE_FMT_DBL  ? "double"         : \
-		fmt == AV_SAMPLE_FMT_U8P  ? "U8, planar"     : \
-		fmt == AV_SAMPLE_FMT_S16P ? "S16, planar"    : \
-		fmt == AV_SAMPLE_FMT_S32P ? "S32, planar"    : \
-		fmt == AV_SAMPLE_FMT_FLTP ? "float, planar"  : \
-		fmt == AV_SAMPLE_FMT_DBLP ? "double, planar" : "unknown")
+const uint8_t cRpiIec61937Packer::Eac3Blocks[4] =
+	{ 1, 2, 3, 6 };
 
 /* ------------------------------------------------------------------------- */
 
@@ -897,32 +469,57 @@ public:
 		m_omx(omx),
 		m_port(cRpiAudioPort::eLocal),
 		m_codec(cAudioCodec::eInvalid),
+		m_coreOnly(false),
 		m_inChannels(0),
+		m_inLayout(0),
 		m_outChannels(0),
 		m_samplingRate(0),
 		m_frameSize(0),
 		m_configured(false),
 		m_running(false),
+		m_setupUses(0),
+		m_switchTime(0),
+		m_switchSetup(false),
+		m_switchGap(0),
 #ifdef DO_RESAMPLE
 		m_resample(0),
 		m_resamplerConfigured(false),
+		m_resamplerUses(0),
+		m_resamplerTime(0),
 #endif
 		m_pcmSampleFormat(AV_SAMPLE_FMT_NONE),
-		m_pts(0)
+		m_pts(0),
+		m_pending(0),
+		m_pendingTime(0),
+		m_buffers(0),
+		m_volume(255),
+		m_mute(false),
+		m_gain(cRpiAudioDsp::eUnityGain),
+		m_iec(false),
+		m_burstPts(0),
+		m_burstSize(0),
+		m_burstWritten(0),
+		m_frameWritten(0)
 	{
+		memset(m_setups, 0, sizeof(m_setups));
+#ifdef DO_RESAMPLE
+		memset(m_resamplers, 0, sizeof(m_resamplers));
+#endif
 	}
 
 	~cRpiAudioRender()
 	{
-		Flush();
+		Stop();
 #ifdef DO_RESAMPLE
-		swr_free(&m_resample);
+		for (int i = 0; i < AUDIO_RESAMPLER_CACHE_SIZE; i++)
+			swr_free(&m_resamplers[i].context);
 #endif
 		delete m_mutex;
 	}
 
 	int WriteSamples(uint8_t** data, int samples, int64_t pts,
-			AVSampleFormat sampleFormat = AV_SAMPLE_FMT_NONE)
+			AVSampleFormat sampleFormat = AV_SAMPLE_FMT_NONE,
+			unsigned int channels = 0, uint64_t channelLayout = 0)
 	{
 		if (!Ready())
 			return 0;
@@ -930,7 +527,9 @@ public:
 		m_mutex->Lock();
 		int copied = 0;
 
-		if (sampleFormat == AV_SAMPLE_FMT_NONE)
+		if (sampleFormat == AV_SAMPLE_FMT_NONE && m_iec)
+			copied = WriteBurst(*data, samples, pts);
+		else if (sampleFormat == AV_SAMPLE_FMT_NONE)
 		{
 			// pass through
 			while (samples > copied)
@@ -949,6 +548,8 @@ public:
 				if (!m_omx->EmptyAudioBuffer(buf))
 					break;
 
+				AddBuffer();
+
 				copied += len;
 				pts = 0;
 			}
@@ -956,58 +557,72 @@ public:
 		else
 		{
 #ifdef DO_RESAMPLE
-			// local decode, do resampling
-			if (!m_resamplerConfigured || m_pcmSampleFormat != sampleFormat)
+			// local decode, do resampling if needed
+			if (!m_resamplerConfigured || m_pcmSampleFormat != sampleFormat ||
+					(channels && (m_inChannels != channels ||
+					 m_inLayout != channelLayout)))
 			{
 				m_pcmSampleFormat = sampleFormat;
-				ApplyResamplerSettings();
-			}
-			if (m_resample)
-			{
-				m_pts = pts ? pts : m_pts;
-				OMX_BUFFERHEADERTYPE *buf = m_omx->GetAudioBuffer(m_pts);
-				if (buf)
+				if (channels)
 				{
-					if (buf->nAllocLen >= (samples * m_outChannels *
-						av_get_bytes_per_sample(AV_SAMPLE_FMT_S16)))
-					{
-						uint8_t *dst[] = { buf->pBuffer };
-						int copiedSamples = swr_convert(m_resample,
-							dst, samples, (const uint8_t **)data, samples);
-
-						buf->nFilledLen = av_samples_get_buffer_size(NULL,
-							m_outChannels, copiedSamples, AV_SAMPLE_FMT_S16, 1);
-
-						m_pts += copiedSamples * 90000 / m_samplingRate;
-					}
-					copied = m_omx->EmptyAudioBuffer(buf) ? samples : 0;
+					m_inChannels = channels;
+					m_inLayout = channelLayout;
 				}
+				ApplyResamplerSettings();
 			}
+			if (m_resamplerConfigured)
+				copied = WritePcm(data, samples, pts);
 #else
-			// local decode, no resampling
-			m_pts = pts ? pts : m_pts;
-			OMX_BUFFERHEADERTYPE *buf = m_omx->GetAudioBuffer(m_pts);
-			if (buf)
+			// local decode, no resampling, unsupported formats are dropped
+			m_pcmSampleFormat = sampleFormat;
+			if (channels)
 			{
-				unsigned int size = samples * m_outChannels *
-						av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
-				if (buf->nAllocLen >= size)
-				{
-					memcpy(buf->pBuffer, *data, size);
-					buf->nFilledLen = size;
-					m_pts += samples * 90000 / m_samplingRate;
-				}
-				copied = m_omx->EmptyAudioBuffer(buf) ? samples : 0;
+				m_inChannels = channels;
+				m_inLayout = channelLayout;
 			}
+			copied = CanCopySamples() ? WritePcm(data, samples, pts) : samples;
 #endif
 		}
+
+		// first audio data after a flush or new setup
+		if (copied && m_switchTime)
+		{
+			unsigned int gap = cTimeMs::Now() - m_switchTime;
+			__atomic_store_n(&m_switchGap, gap, __ATOMIC_RELAXED);
+			m_switchTime = 0;
+
+			syslog(LOG_DEBUG, "[cRpiAudioRender] audio output resumed after %dms (%s)",
+					gap, m_switchSetup ? "new output setup" : "output setup kept");
+		}
 		m_mutex->Unlock();
 		return copied;
 	}
 
+	// Discards pending audio data, but keeps the render set up, so a new
+	// stream with the same output format starts without reconfiguration.
 	void Flush(void)
 	{
 		m_mutex->Lock();
+		m_omx->ReturnAudioBuffer(m_pending);
+		m_pending = 0;
+		m_frameWritten = 0;
+		ResetBurst();
+		if (m_running)
+		{
+			m_omx->FlushAudio();
+			StartSwitch();
+		}
+		m_pts = 0;
+		m_mutex->Unlock();
+	}
+
+	void Stop(void)
+	{
+		m_mutex->Lock();
+		m_omx->ReturnAudioBuffer(m_pending);
+		m_pending = 0;
+		m_frameWritten = 0;
+		ResetBurst();
 		if (m_running)
 			m_omx->StopAudio();
 		m_configured = false;
@@ -1016,51 +631,111 @@ public:
 		m_mutex->Unlock();
 	}
 
+	// Writes the packed PCM buffer to the OMX render when its deadline has
+	// passed. Returns the time in ms until the render needs to be polled
+	// again, either for the deadline of the packed buffer or to apply new
+	// settings once drained, 0 if there's nothing to wait for.
+	unsigned int Poll(void)
+	{
+		m_mutex->Lock();
+		unsigned int ms = 0;
+		if (m_pending)
+		{
+			uint64_t now = cTimeMs::Now();
+			if (now >= m_pendingTime + AUDIO_PACK_DEADLINE)
+				WritePending();
+			else
+				ms = m_pendingTime + AUDIO_PACK_DEADLINE - now;
+		}
+		unsigned int drain = GetDrainTime();
+		if (drain && (!ms || drain < ms))
+			ms = drain;
+
+		m_mutex->Unlock();
+		return ms;
+	}
+
+	// number of OMX buffers written to the render so far
+	unsigned int GetNumBuffers(void)
+	{
+		return __atomic_load_n(&m_buffers, __ATOMIC_RELAXED);
+	}
+
+	// duration of the last audio gap caused by a flush or new setup in ms
+	unsigned int GetSwitchGap(void)
+	{
+		return __atomic_load_n(&m_switchGap, __ATOMIC_RELAXED);
+	}
+
+	// time the last reconfiguration of the resampler took in us
+	unsigned int GetResamplerTime(void)
+	{
+#ifdef DO_RESAMPLE
+		return __atomic_load_n(&m_resamplerTime, __ATOMIC_RELAXED);
+#else
+		return 0;
+#endif
+	}
+
+	// forget selected output formats, e.g. when the audio setup changed
+	void ClearSetupCache(void)
+	{
+		m_mutex->Lock();
+		memset(m_setups, 0, sizeof(m_setups));
+		m_mutex->Unlock();
+	}
+
 	void SetCodec(cAudioCodec::eCodec codec, unsigned int channels,
-			unsigned int samplingRate, unsigned int frameSize)
+			unsigned int coreChannels, unsigned int samplingRate,
+			unsigned int frameSize, unsigned int coreSize)
 	{
 		m_mutex->Lock();
 		if (codec != cAudioCodec::eInvalid && channels > 0)
 		{
-			m_inChannels = channels;
+			// if not passed through, only the core of the stream is decoded
+#ifdef DO_RESAMPLE
+			if (m_inChannels != coreChannels)
+				m_resamplerConfigured = false;
+#endif
+			m_inChannels = coreChannels;
+			m_inLayout = 0;
 			cRpiAudioPort::ePort newPort = cRpiSetup::GetAudioPort();
-			cAudioCodec::eCodec newCodec = cAudioCodec::ePCM;
 
 			syslog(LOG_DEBUG, "[cRpiAudioRender] new audio codec: %dch %s", channels, cAudioCodec::Str(codec));
 
-			if (newPort == cRpiAudioPort::eHDMI)
-			{
-				// check if pass through is possible
-				if (cRpiSetup::IsAudioFormatSupported(codec, channels,
-							samplingRate))
-					newCodec = codec;
-
-				// check for multi channel PCM, stereo downmix if not supported
-				else if (!cRpiSetup::IsAudioFormatSupported(cAudioCodec::ePCM,
-						channels, samplingRate))
-					channels = 2;
-			}
-			else
-				channels = 2;
+			Setup *setup = GetSetup(codec, channels, coreChannels,
+					samplingRate, frameSize != coreSize, newPort);
+
+			cAudioCodec::eCodec newCodec = setup->outCodec;
+			bool coreOnly = setup->coreOnly;
+			bool iec = setup->iec;
+			channels = setup->outChannels;
+			if (coreOnly)
+				frameSize = coreSize;
 
 			// if the user changes the port, this should change immediately
 			if (newPort != m_port)
-				Flush();
+				Stop();
 
 			// save new settings to be applied when render is ready
 			if (newPort != m_port || m_codec != newCodec ||
-					m_outChannels != channels || m_samplingRate != samplingRate)
+					m_outChannels != channels || m_samplingRate != samplingRate ||
+					m_coreOnly != coreOnly || m_iec != iec)
 			{
 				m_configured = false;
 				m_port = newPort;
 				m_codec = newCodec;
+				m_coreOnly = coreOnly;
+				m_iec = iec;
+				ResetBurst();
 				m_outChannels = channels;
 				m_samplingRate = samplingRate;
 				m_frameSize = frameSize;
-			}
+				StartSwitch();
 #ifdef DO_RESAMPLE
-			m_resamplerConfigured = false;
+				m_resamplerConfigured = false;
 #endif
+			}
 		}
 		m_mutex->Unlock();
 	}
@@ -1070,356 +745,1697 @@ public:
 		return m_codec != cAudioCodec::ePCM;
 	}
 
-	int GetChannels(void)
+	// volume and mute can only be applied to decoded audio, before the first
+	// setup they'll be applied once audio gets decoded
+	bool IsVolumeCapable(void)
+	{
+		return m_codec == cAudioCodec::eInvalid || !IsPassthrough();
+	}
+
+	// volume in the range of 0..255
+	void SetVolume(int vol)
+	{
+		m_mutex->Lock();
+		m_volume = vol < 0 ? 0 : vol > 255 ? 255 : vol;
+		m_mutex->Unlock();
+	}
+
+	void SetMute(bool mute)
+	{
+		m_mutex->Lock();
+		m_mute = mute;
+		m_mutex->Unlock();
+	}
+
+	// Returns the time in ms until the render is expected to be drained
+	// when it's waiting to apply new settings, 0 otherwise.
+	unsigned int GetDrainTime(void)
+	{
+		if (m_configured || !m_running || !m_samplingRate)
+			return 0;
+
+		unsigned int ms = m_omx->GetAudioLatency() * 1000 / GetOutputRate();
+		return ms ? ms : 1;
+	}
+
+	// true if only the core of the stream is passed through, since the sink
+	// doesn't support its extensions (e.g. DTS core of DTS-HD)
+	bool IsCoreOnly(void)
+	{
+		return m_coreOnly;
+	}
+
+	int GetChannels(void)
+	{
+		return m_outChannels;
+	}
+
+	bool Ready(void)
+	{
+		if (!m_configured)
+		{
+			// audio of the previous setup still to be written
+			if (m_pending)
+				WritePending();
+
+			// wait until render is ready before applying new settings
+			if (m_running && m_omx->GetAudioLatency())
+				return false;
+
+			ApplyRenderSettings();
+		}
+		return true;
+	}
+
+private:
+
+	cRpiAudioRender(const cRpiAudioRender&);
+	cRpiAudioRender& operator= (const cRpiAudioRender&);
+
+	// audio stream parameters and the output format selected for them
+	struct Setup
+	{
+		cAudioCodec::eCodec  codec;
+		unsigned int         channels;
+		unsigned int         coreChannels;
+		unsigned int         samplingRate;
+		bool                 extensions;
+		cRpiAudioPort::ePort port;
+
+		cAudioCodec::eCodec  outCodec;
+		unsigned int         outChannels;
+		bool                 coreOnly;
+		bool                 iec;	// pass-through packed in IEC 61937
+		unsigned int         lastUsed;	// 0 if unused
+	};
+
+	// Returns the output setup for the given stream, either a recently used
+	// one or a newly selected one replacing the least recently used entry.
+	Setup* GetSetup(cAudioCodec::eCodec codec, unsigned int channels,
+			unsigned int coreChannels, unsigned int samplingRate,
+			bool extensions, cRpiAudioPort::ePort port)
+	{
+		Setup *setup = &m_setups[0];
+		for (int i = 0; i < AUDIO_SETUP_CACHE_SIZE; i++)
+		{
+			Setup *s = &m_setups[i];
+			if (s->lastUsed && s->codec == codec && s->channels == channels &&
+					s->coreChannels == coreChannels &&
+					s->samplingRate == samplingRate &&
+					s->extensions == extensions && s->port == port)
+			{
+				s->lastUsed = ++m_setupUses;
+				return s;
+			}
+			if (s->lastUsed < setup->lastUsed)
+				setup = s;
+		}
+
+		setup->codec = codec;
+		setup->channels = channels;
+		setup->coreChannels = coreChannels;
+		setup->samplingRate = samplingRate;
+		setup->extensions = extensions;
+		setup->port = port;
+		setup->outCodec = cAudioCodec::ePCM;
+		setup->outChannels = 2;
+		setup->coreOnly = false;
+		setup->iec = false;
+		setup->lastUsed = ++m_setupUses;
+
+		if (port == cRpiAudioPort::eHDMI)
+		{
+			// check if pass through is possible, either of the whole
+			// stream or of its core without extensions
+			if (cRpiSetup::IsAudioFormatSupported(codec, channels,
+						samplingRate, extensions))
+			{
+				setup->outCodec = codec;
+				setup->outChannels = channels;
+			}
+			else if (extensions && cRpiSetup::IsAudioFormatSupported(
+					codec, coreChannels, samplingRate))
+			{
+				setup->outCodec = codec;
+				setup->outChannels = coreChannels;
+				setup->coreOnly = true;
+			}
+			// check for multi channel PCM, stereo downmix if not supported
+			else if (cRpiSetup::IsAudioFormatSupported(cAudioCodec::ePCM,
+					coreChannels, samplingRate))
+				setup->outChannels = coreChannels;
+
+			if (setup->outCodec != cAudioCodec::ePCM &&
+					cRpiSetup::IsAudioIec61937())
+				setup->iec = cRpiIec61937Packer::IsSupported(setup->outCodec,
+						samplingRate, extensions && !setup->coreOnly);
+		}
+		return setup;
+	}
+
+	// starts measuring the gap until audio output resumes
+	void StartSwitch(void)
+	{
+		if (!m_switchTime)
+		{
+			m_switchTime = cTimeMs::Now();
+			m_switchSetup = false;
+		}
+	}
+
+	void ApplyRenderSettings(void)
+	{
+		if (m_running)
+			m_omx->StopAudio();
+
+		if (m_codec != cAudioCodec::eInvalid)
+		{
+			// IEC 61937 bursts are sent as stereo PCM
+			if (m_port == cRpiAudioPort::eHDMI)
+				cRpiSetup::SetHDMIChannelMapping(m_codec != cAudioCodec::ePCM,
+						m_iec ? 2 : m_outChannels);
+
+			if (m_iec)
+				m_omx->SetupAudioRender(cAudioCodec::ePCM, 2, m_port,
+						GetOutputRate(), 0);
+			else
+				m_omx->SetupAudioRender(m_codec, m_outChannels, m_port,
+						m_samplingRate, m_frameSize);
+
+			syslog(LOG_DEBUG, "[cRpiAudioRender] set %s audio output format to %dch %s, %d.%dkHz%s",
+					cRpiAudioPort::Str(m_port), m_outChannels,
+					cAudioCodec::Str(m_codec),
+					m_samplingRate / 1000, (m_samplingRate % 1000) / 100,
+					m_iec ? " (IEC 61937 pass-through)" :
+					m_codec != cAudioCodec::ePCM ? " (pass-through)" : "");
+		}
+		m_running = m_codec != cAudioCodec::eInvalid;
+		m_configured = true;
+		m_switchSetup = true;
+	}
+
+	// sampling rate of the audio render, which differs from the stream's one
+	// for some codecs packed in IEC 61937 bursts
+	unsigned int GetOutputRate(void)
+	{
+		return m_iec ? m_samplingRate *
+				cRpiIec61937Packer::GetRateFactor(m_codec) : m_samplingRate;
+	}
+
+	// Packs a pass-through frame into an IEC 61937 burst and writes the
+	// burst once it's complete. Returns the frame size when the frame has
+	// been consumed, 0 if the burst has to be written again, which doesn't
+	// pack the frame again, since the decoder passes the same frame.
+	int WriteBurst(uint8_t *data, int size, int64_t pts)
+	{
+		if (!m_burstSize)
+		{
+			if (m_packer.IsEmpty())
+				m_burstPts = pts;
+
+			int ret = m_packer.Pack(m_codec, data, size);
+			if (ret < 0)
+				syslog(LOG_ERR, "[cRpiAudioRender] failed to pack %s frame, "
+						"dropped!", cAudioCodec::Str(m_codec));
+			else
+				m_burstSize = ret;
+		}
+
+		while (m_burstWritten < m_burstSize)
+		{
+			OMX_BUFFERHEADERTYPE *buf =
+					m_omx->GetAudioBuffer(m_burstWritten ? 0 : m_burstPts);
+			if (!buf)
+				break;
+
+			unsigned int len = std::min(m_burstSize - m_burstWritten,
+					(unsigned int)buf->nAllocLen);
+
+			memcpy(buf->pBuffer, m_packer.GetBurst() + m_burstWritten, len);
+			buf->nFilledLen = len;
+
+			if (!m_omx->EmptyAudioBuffer(buf))
+				break;
+
+			AddBuffer();
+			m_burstWritten += len;
+		}
+
+		if (m_burstWritten < m_burstSize)
+			return 0;
+
+		m_burstSize = 0;
+		m_burstWritten = 0;
+		return size;
+	}
+
+	// discards incomplete bursts
+	void ResetBurst(void)
+	{
+		m_packer.Reset();
+		m_burstSize = 0;
+		m_burstWritten = 0;
+	}
+
+	// Writes decoded samples to the render's PCM buffers. Frames which don't
+	// fit a single buffer are split. Returns the number of samples once the
+	// whole frame has been written, 0 if it has to be written again, which
+	// continues after the samples written so far, or -1 if the frame has
+	// been dropped due to an error.
+	int WritePcm(uint8_t **data, int samples, int64_t pts)
+	{
+		unsigned int frameSize = m_outChannels *
+				av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
+
+		while (m_frameWritten < samples)
+		{
+			int n = samples - m_frameWritten;
+			OMX_BUFFERHEADERTYPE *buf = GetPcmBuffer(n * frameSize,
+					m_frameWritten ? OMX_INVALID_PTS : pts);
+			if (!buf)
+				return 0;
+
+			n = std::min<unsigned int>(n,
+					(buf->nAllocLen - buf->nFilledLen) / frameSize);
+
+			// continue after the samples already written
+			uint8_t *planes[AV_NUM_DATA_POINTERS];
+			uint8_t **src = data;
+			if (m_frameWritten)
+			{
+				if (!OffsetSamples(planes, data, m_frameWritten))
+				{
+					syslog(LOG_ERR, "[cRpiAudioRender] failed to split %dch audio frame, dropped!",
+							m_inChannels);
+					m_frameWritten = 0;
+					return -1;
+				}
+				src = planes;
+			}
+
+			uint8_t *dst = buf->pBuffer + buf->nFilledLen;
+#ifdef DO_RESAMPLE
+			if (m_resample)
+			{
+				uint8_t *resampled[AV_NUM_DATA_POINTERS];
+				for (unsigned int c = 0; c < m_outChannels; c++)
+					resampled[c] = (uint8_t *)m_resampled[c];
+
+				n = swr_convert(m_resample, resampled,
+						std::min(n, AUDIO_RESAMPLE_SAMPLES),
+						(const uint8_t **)src, n);
+				if (n < 0)
+				{
+					syslog(LOG_ERR, "[cRpiAudioRender] failed to convert audio frame, dropped!");
+					m_frameWritten = 0;
+					return -1;
+				}
+				CopyResampled(dst, n);
+			}
+			else
+#endif
+				CopySamples(dst, src, n);
+
+			buf->nFilledLen += n * frameSize;
+			if (m_pts)
+				m_pts += n * 90000 / m_samplingRate;
+
+			m_frameWritten += n;
+			if (!PackPcmBuffer(n * frameSize))
+				return 0;
+		}
+		m_frameWritten = 0;
+		return samples;
+	}
+
+	// Sets planes to the given sample offset of decoder output. Returns
+	// false if the output has more planes than supported.
+	bool OffsetSamples(uint8_t **planes, uint8_t **data, int offset)
+	{
+		bool planar = av_sample_fmt_is_planar(m_pcmSampleFormat);
+		unsigned int n = planar ? m_inChannels : 1;
+		unsigned int stride = av_get_bytes_per_sample(m_pcmSampleFormat) *
+				(planar ? 1 : m_inChannels);
+
+		if (n > AV_NUM_DATA_POINTERS)
+			return false;
+
+		for (unsigned int p = 0; p < n; p++)
+			planes[p] = data[p] + offset * stride;
+
+		return true;
+	}
+
+	// Returns the buffer to append a PCM frame of the given size in bytes to,
+	// which is the pending buffer as long as the frame fits and continues
+	// the stream. Frames without time stamp always continue the stream.
+	// Otherwise, the pending buffer is written to the render and a new one
+	// started with the frame's time stamp.
+	OMX_BUFFERHEADERTYPE* GetPcmBuffer(unsigned int size, int64_t pts)
+	{
+		bool hasPts = pts && pts != OMX_INVALID_PTS;
+		if (m_pending && (m_pending->nFilledLen + size > m_pending->nAllocLen ||
+				(hasPts && llabs(pts - m_pts) > AUDIO_PACK_PTS_TOLERANCE)))
+			if (!WritePending())
+				return 0;
+
+		if (hasPts)
+			m_pts = pts;
+
+		if (!m_pending)
+		{
+			m_pending = m_omx->GetAudioBuffer(m_pts ? m_pts : OMX_INVALID_PTS);
+			m_pendingTime = cTimeMs::Now();
+		}
+		return m_pending;
+	}
+
+	// Writes the pending buffer, if it can't take another frame of the given
+	// size or frames aren't packed. Returns false if writing failed.
+	bool PackPcmBuffer(unsigned int size)
+	{
+		if (AUDIO_PACK_DEADLINE && m_pending->nFilledLen &&
+				m_pending->nFilledLen + size <= m_pending->nAllocLen)
+			return true;
+
+		return WritePending();
+	}
+
+	bool WritePending(void)
+	{
+		OMX_BUFFERHEADERTYPE *buf = m_pending;
+		m_pending = 0;
+		if (!m_omx->EmptyAudioBuffer(buf))
+			return false;
+
+		AddBuffer();
+		return true;
+	}
+
+	void AddBuffer(void)
+	{
+		__atomic_store_n(&m_buffers, m_buffers + 1, __ATOMIC_RELAXED);
+	}
+
+	// true if decoder output can be converted to the render format by
+	// CopySamples(), which covers the most common formats of our decoders.
+	// Only 5.1 with known channel order is down mixed to stereo.
+	bool CanCopySamples(void)
+	{
+		if (m_pcmSampleFormat == AV_SAMPLE_FMT_FLTP)
+			return m_inChannels == m_outChannels ||
+					(m_inChannels == 6 && m_outChannels == 2 &&
+					 (m_inLayout == AV_CH_LAYOUT_5POINT1 ||
+					  m_inLayout == AV_CH_LAYOUT_5POINT1_BACK));
+
+		return m_inChannels == m_outChannels &&
+				(m_pcmSampleFormat == AV_SAMPLE_FMT_S16 ||
+				 m_pcmSampleFormat == AV_SAMPLE_FMT_S16P);
+	}
+
+	// Returns the gain to be applied to the next n of the given samples,
+	// which is constant for all samples if no ramp is in progress.
+	int RampGain(int samples, int &n)
+	{
+		int target = m_mute ? 0 : m_volume * cRpiAudioDsp::eUnityGain / 255;
+		n = samples;
+		if (m_gain == target)
+			return m_gain;
+
+		int step = cRpiAudioDsp::eUnityGain * AUDIO_GAIN_STEP * 1000 /
+				(m_samplingRate * AUDIO_GAIN_RAMP) + 1;
+
+		m_gain = m_gain < target ? std::min(m_gain + step, target) :
+				std::max(m_gain - step, target);
+
+		if (n > AUDIO_GAIN_STEP)
+			n = AUDIO_GAIN_STEP;
+
+		return m_gain;
+	}
+
+	// Copies samples to the render's interleaved 16 bit output buffer, if
+	// decoder output already matches the render format except for planes,
+	// or converts planar float samples, down mixing 5.1 to stereo. Volume
+	// is applied in the same pass.
+	void CopySamples(uint8_t *dst, uint8_t **data, int samples)
+	{
+		for (int i = 0, n; i < samples; i += n)
+		{
+			int gain = RampGain(samples - i, n);
+
+			uint8_t *src[AV_NUM_DATA_POINTERS];
+			OffsetSamples(src, data, i);
+
+			ConvertSamples(dst + i * m_outChannels * sizeof(int16_t), src, n,
+					gain);
+		}
+	}
+
+	void ConvertSamples(uint8_t *dst, uint8_t **data, int samples, int gain)
+	{
+		float fltGain = (float)gain / cRpiAudioDsp::eUnityGain;
+		if (m_pcmSampleFormat == AV_SAMPLE_FMT_FLTP)
+		{
+			if (m_inChannels != m_outChannels)
+				cRpiAudioDsp::Downmix51Flt((int16_t *)dst,
+						(const float *const *)data, samples, fltGain);
+			else
+				cRpiAudioDsp::ConvertFlt((int16_t *)dst,
+						(const float *const *)data, m_outChannels, samples,
+						fltGain);
+		}
+		else if (av_sample_fmt_is_planar(m_pcmSampleFormat) && m_outChannels > 1)
+			cRpiAudioDsp::Interleave16((int16_t *)dst,
+					(const int16_t *const *)data, m_outChannels, samples, gain);
+		else if (gain < cRpiAudioDsp::eUnityGain)
+			cRpiAudioDsp::Interleave16((int16_t *)dst,
+					(const int16_t *const *)data, 1, samples * m_outChannels,
+					gain);
+		else
+			memcpy(dst, *data, samples * m_outChannels * sizeof(int16_t));
+	}
+
+#ifdef DO_RESAMPLE
+	// Converts planar float output of the resampler to the render's
+	// interleaved 16 bit output buffer, applying volume in the same pass.
+	void CopyResampled(uint8_t *dst, int samples)
+	{
+		for (int i = 0, n; i < samples; i += n)
+		{
+			float gain = (float)RampGain(samples - i, n) /
+					cRpiAudioDsp::eUnityGain;
+
+			const float *src[AV_NUM_DATA_POINTERS];
+			for (unsigned int c = 0; c < m_outChannels; c++)
+				src[c] = m_resampled[c] + i;
+
+			cRpiAudioDsp::ConvertFlt((int16_t *)dst +
+					i * m_outChannels, src, m_outChannels, n, gain);
+		}
+	}
+
+	// resampler context initialized for the given input and output format
+	struct Resampler
+	{
+		SwrContext          *context;
+		AVSampleFormat       format;
+		unsigned int         inChannels;
+		uint64_t             inLayout;
+		unsigned int         outChannels;
+		unsigned int         samplingRate;
+		unsigned int         lastUsed;	// 0 if unused
+	};
+
+	void ApplyResamplerSettings(void)
+	{
+		uint64_t start = NowUs();
+		m_resample = 0;
+
+		// the most common formats are converted without resampler
+		if (CanCopySamples())
+		{
+			syslog(LOG_DEBUG, "[cRpiAudioRender] converting %dch %s without resampler",
+					m_inChannels, AV_SAMPLE_STR(m_pcmSampleFormat));
+			m_resamplerConfigured = true;
+			return;
+		}
+
+		bool cached = false;
+		m_resample = GetResampler(cached);
+		m_resamplerConfigured = m_resample != 0;
+
+		unsigned int us = NowUs() - start;
+		__atomic_store_n(&m_resamplerTime, us, __ATOMIC_RELAXED);
+		if (m_resample)
+			syslog(LOG_DEBUG, "[cRpiAudioRender] %s resampler for %dch %s to %dch, took %dus",
+					cached ? "reusing" : "new", m_inChannels,
+					AV_SAMPLE_STR(m_pcmSampleFormat), m_outChannels, us);
+	}
+
+	// Returns a resampler context for the current format, either a cached
+	// one or a newly initialized one replacing the least recently used entry.
+	// Since the sampling rate isn't changed, contexts don't hold any samples
+	// between calls and may be reused as they are.
+	SwrContext* GetResampler(bool &cached)
+	{
+		Resampler *resampler = &m_resamplers[0];
+		for (int i = 0; i < AUDIO_RESAMPLER_CACHE_SIZE; i++)
+		{
+			Resampler *r = &m_resamplers[i];
+			if (r->lastUsed && r->format == m_pcmSampleFormat &&
+					r->inChannels == m_inChannels &&
+					r->inLayout == m_inLayout &&
+					r->outChannels == m_outChannels &&
+					r->samplingRate == m_samplingRate)
+			{
+				r->lastUsed = ++m_resamplerUses;
+				cached = true;
+				return r->context;
+			}
+			if (r->lastUsed < resampler->lastUsed)
+				resampler = r;
+		}
+
+		swr_free(&resampler->context);
+		resampler->lastUsed = 0;
+
+		SwrContext *context = swr_alloc();
+		if (!context)
+		{
+			syslog(LOG_ERR, "[cRpiAudioRender] failed to allocate resampling context!");
+			return 0;
+		}
+
+		av_opt_set_int(context, "in_sample_rate", m_samplingRate, 0);
+		av_opt_set_int(context, "in_sample_fmt", m_pcmSampleFormat, 0);
+		av_opt_set_int(context, "in_channel_count", m_inChannels, 0);
+		av_opt_set_int(context, "in_channel_layout",
+				m_inLayout ? m_inLayout : AV_CH_LAYOUT(m_inChannels), 0);
+
+		av_opt_set_int(context, "out_sample_rate", m_samplingRate, 0);
+		av_opt_set_int(context, "out_sample_fmt", AV_SAMPLE_FMT_FLTP, 0);
+		av_opt_set_int(context, "out_channel_count", m_outChannels, 0);
+		av_opt_set_int(context, "out_channel_layout",
+				AV_CH_LAYOUT(m_outChannels), 0);
+
+		if (swr_init(context) < 0)
+		{
+			syslog(LOG_ERR, "[cRpiAudioRender] failed to initialize resampling context!");
+			swr_free(&context);
+			return 0;
+		}
+
+		resampler->context = context;
+		resampler->format = m_pcmSampleFormat;
+		resampler->inChannels = m_inChannels;
+		resampler->inLayout = m_inLayout;
+		resampler->outChannels = m_outChannels;
+		resampler->samplingRate = m_samplingRate;
+		resampler->lastUsed = ++m_resamplerUses;
+		return context;
+	}
+#endif
+
+	cMutex		        *m_mutex;
+	cOmx		        *m_omx;
+
+	cRpiAudioPort::ePort m_port;
+	cAudioCodec::eCodec  m_codec;
+	bool                 m_coreOnly;
+	unsigned int         m_inChannels;
+	uint64_t             m_inLayout;	// of decoder output, 0 if unknown
+	unsigned int         m_outChannels;
+	unsigned int         m_samplingRate;
+	unsigned int         m_frameSize;
+	bool                 m_configured;
+	bool                 m_running;
+
+	Setup                m_setups[AUDIO_SETUP_CACHE_SIZE];
+	unsigned int         m_setupUses;
+	uint64_t             m_switchTime;
+	bool                 m_switchSetup;
+	unsigned int         m_switchGap;
+
+#ifdef DO_RESAMPLE
+	SwrContext          *m_resample;	// one of the cached resamplers
+	bool                 m_resamplerConfigured;
+	Resampler            m_resamplers[AUDIO_RESAMPLER_CACHE_SIZE];
+	unsigned int         m_resamplerUses;
+	unsigned int         m_resamplerTime;
+	float                m_resampled[AV_NUM_DATA_POINTERS][AUDIO_RESAMPLE_SAMPLES];
+#endif
+
+	AVSampleFormat       m_pcmSampleFormat;
+	int64_t              m_pts;
+
+	OMX_BUFFERHEADERTYPE *m_pending;	// PCM buffer being packed
+	uint64_t             m_pendingTime;
+	unsigned int         m_buffers;
+
+	int                  m_volume;
+	bool                 m_mute;
+	int                  m_gain;	// current gain, see cRpiAudioDsp
+
+	bool                 m_iec;		// pass-through packed in IEC 61937
+	cRpiIec61937Packer   m_packer;
+	int64_t              m_burstPts;
+	unsigned int         m_burstSize;	// burst being written
+	unsigned int         m_burstWritten;
+
+	int                  m_frameWritten;	// samples of a split PCM frame
+};
+
+/* ------------------------------------------------------------------------- */
+
+// cMutexLock counting its locks, e.g. for the stage statistics. Like
+// cMutexLock, it does nothing without a mutex. The counter may be shared by
+// threads, so it's incremented atomically.
+
+class cCountingMutexLock : public cMutexLock
+{
+
+public:
+
+	cCountingMutexLock(cMutex *mutex, unsigned int &count) : cMutexLock(mutex)
+	{
+		if (mutex)
+			__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	}
+};
+
+/* ------------------------------------------------------------------------- */
+
+// Optional second stage of the audio pipeline: writes decoded frames from the
+// queue to the render, so resampling and waiting for OMX buffers don't hold
+// up the decoder thread. Render access of both threads is serialized by the
+// decoder's render mutex.
+
+class cRpiAudioDecoder::cRenderThread : public cThread
+{
+
+public:
+
+	cRenderThread(cRpiAudioDecoder *decoder) :
+		cThread("audio render"),
+		m_decoder(decoder),
+		m_sleeping(false),
+		m_wait(new cCondWait())
+	{
+	}
+
+	~cRenderThread()
+	{
+		delete m_wait;
+	}
+
+	void Stop(void)
+	{
+		Cancel(-1);
+		m_wait->Signal();
+		Cancel(3);
+	}
+
+	// called on new frames in the queue or a free audio buffer
+	void Wakeup(void)
+	{
+		if (__atomic_load_n(&m_sleeping, __ATOMIC_SEQ_CST))
+			m_wait->Signal();
+	}
+
+protected:
+
+	virtual void Action(void)
+	{
+		SetPriority(cRpiSetup::GetAudioRenderPriority());
+		SetAffinity(cRpiSetup::GetAudioRenderCpu());
+
+		while (Running())
+		{
+			unsigned int bufferEvents = __atomic_load_n(
+					&m_decoder->m_bufferEvents, __ATOMIC_SEQ_CST);
+			unsigned int writeIndex = m_decoder->m_queue->WriteIndex();
+
+			if (m_decoder->WriteFrames())
+			{
+				// decoder may wait for space in queue
+				if (__atomic_load_n(&m_decoder->m_sleeping, __ATOMIC_SEQ_CST))
+					m_decoder->m_wait->Signal();
+				continue;
+			}
+
+			unsigned int timeout;
+			{
+				cCountingMutexLock lock(m_decoder->m_renderMutex,
+						m_decoder->m_stageStats.renderLocks);
+				timeout = m_decoder->m_render->Poll();
+			}
+			__atomic_store_n(&m_sleeping, true, __ATOMIC_SEQ_CST);
+			if (writeIndex == m_decoder->m_queue->WriteIndex() &&
+					bufferEvents == __atomic_load_n(
+							&m_decoder->m_bufferEvents, __ATOMIC_SEQ_CST))
+				m_wait->Wait(timeout);
+			__atomic_store_n(&m_sleeping, false, __ATOMIC_RELAXED);
+		}
+	}
+
+private:
+
+	cRenderThread(const cRenderThread&);
+	cRenderThread& operator= (const cRenderThread&);
+
+	cRpiAudioDecoder *m_decoder;
+	bool			  m_sleeping;
+	cCondWait		 *m_wait;
+};
+
+/* ------------------------------------------------------------------------- */
+
+// Statistics counters have a single writer each, either the decoder or the
+// render stage, so they're updated without atomic read-modify-write, which
+// keeps collecting them as cheap as a plain increment. Readers may see
+// counters of the same frame not yet updated consistently.
+
+template<class T> static inline void AddCount(T &counter, T value)
+{
+	__atomic_store_n(&counter,
+			__atomic_load_n(&counter, __ATOMIC_RELAXED) + value,
+			__ATOMIC_RELAXED);
+}
+
+static inline void AddHistogram(unsigned int *histogram, unsigned int us)
+{
+	int i = us ? 32 - __builtin_clz(us) : 0;
+	AddCount(histogram[std::min(i,
+			(int)cRpiAudioDecoder::eHistogramSize - 1)], 1U);
+}
+
+// accounts a frame of a pipeline stage which has been started at given time
+static inline unsigned int AddStageTime(unsigned int &frames, uint64_t &time,
+		unsigned int &max, uint64_t start)
+{
+	unsigned int us = NowUs() - start;
+	AddCount(frames, 1U);
+	AddCount(time, (uint64_t)us);
+	if (us > __atomic_load_n(&max, __ATOMIC_RELAXED))
+		__atomic_store_n(&max, us, __ATOMIC_RELAXED);
+	return us;
+}
+
+/* ------------------------------------------------------------------------- */
+
+cRpiAudioDecoder::cRpiAudioDecoder(cOmx *omx) :
+	cThread("audio decoder"),
+	m_passthrough(false),
+	m_reset(false),
+	m_resetRequest(0),
+	m_resetAck(0),
+	m_stopped(true),
+	m_setupChanged(true),
+	m_sleeping(false),
+	m_bufferEvents(0),
+	m_bufferEventTime(0),
+	m_codecHint(cAudioCodec::eInvalid),
+	m_prewarm(cAudioCodec::eNumCodecs),
+	m_nextMemoryCheck(0),
+	m_omx(omx),
+	m_wait(new cCondWait()),
+	m_ackMutex(new cMutex()),
+	m_ack(new cCondVar()),
+	m_parser(new cParser()),
+	m_queue(new cFrameQueue()),
+	m_pool(new cBufferPool()),
+	m_render(new cRpiAudioRender(omx)),
+#ifdef AUDIO_RENDER_THREAD
+	m_renderThread(new cRenderThread(this)),
+	m_renderMutex(new cMutex())
+#else
+	m_renderThread(0),
+	m_renderMutex(0)
+#endif
+{
+	memset(m_codecs, 0, sizeof(m_codecs));
+	memset(&m_stageStats, 0, sizeof(m_stageStats));
+	memset(m_codecStats, 0, sizeof(m_codecStats));
+	memset(&m_load, 0, sizeof(m_load));
+}
+
+cRpiAudioDecoder::~cRpiAudioDecoder()
+{
+	if (Active())
+		Reset();
+
+	delete m_renderThread;
+	delete m_renderMutex;
+	delete m_render;
+	delete m_queue;
+	delete m_pool;
+	delete m_parser;
+	delete m_ack;
+	delete m_ackMutex;
+	delete m_wait;
+}
+
+int cRpiAudioDecoder::Init(void)
+{
+	int ret = m_parser->Init();
+	if (ret)
+		return ret;
+
+	ret = m_queue->Init();
+	if (ret)
+	{
+		syslog(LOG_ERR, "[cRpiAudioDecoder] failed to allocate audio frames!");
+		m_parser->DeInit();
+		return ret;
+	}
+
+	cRpiAudioDsp::Init();
+
+	avcodec_register_all();
+
+	m_codecs[cAudioCodec::ePCM     ].codec = NULL;
+	m_codecs[cAudioCodec::eMPG     ].codec = FindDecoder(AV_CODEC_ID_MP3, "mp3");
+	m_codecs[cAudioCodec::eAC3     ].codec = FindDecoder(AV_CODEC_ID_AC3, "ac3_fixed");
+	m_codecs[cAudioCodec::eEAC3    ].codec = avcodec_find_decoder(AV_CODEC_ID_EAC3);
+	m_codecs[cAudioCodec::eAAC     ].codec = avcodec_find_decoder(AV_CODEC_ID_AAC);
+	m_codecs[cAudioCodec::eAAC_LATM].codec = avcodec_find_decoder(AV_CODEC_ID_AAC);
+	m_codecs[cAudioCodec::eDTS     ].codec = avcodec_find_decoder(AV_CODEC_ID_DTS);
+
+	// decoders get opened by decoder thread on first use or when idle if
+	// prewarming is enabled
+#ifdef AUDIO_DECODER_PREWARM
+	m_prewarm = 0;
+#endif
+
+	if (!ret)
+	{
+		cRpiSetup::SetAudioSetupChangedCallback(&OnAudioSetupChanged, this);
+		m_omx->SetAudioBufferEmptiedCallback(&OnAudioBufferEmptied, this);
+		memset(&m_stageStats, 0, sizeof(m_stageStats));
+		memset(m_codecStats, 0, sizeof(m_codecStats));
+		memset(&m_load, 0, sizeof(m_load));
+		m_load.recovery = AUDIO_LOAD_RECOVERY;
+		m_stopped = false;
+		Start();
+		if (m_renderThread)
+			m_renderThread->Start();
+	}
+	else
+		DeInit();
+
+	return ret;
+}
+
+int cRpiAudioDecoder::DeInit(void)
+{
+	Lock();
+
+	Reset();
+	Cancel(-1);
+	m_wait->Signal();
+
+	m_ackMutex->Lock();
+	while (!m_stopped)
+		m_ack->Wait(*m_ackMutex);
+	m_ackMutex->Unlock();
+
+	if (m_renderThread)
+		m_renderThread->Stop();
+
+	m_render->Stop();
+	cRpiSetup::SetAudioSetupChangedCallback(0);
+	m_omx->SetAudioBufferEmptiedCallback(0, 0);
+
+	for (int i = 0; i < cAudioCodec::eNumCodecs; i++)
+		CloseCodec(static_cast<cAudioCodec::eCodec>(i));
+
+	av_log_set_callback(&av_log_default_callback);
+	m_queue->DeInit();
+	m_pool->Clear();
+	m_parser->DeInit();
+
+	Unlock();
+	return 0;
+}
+
+bool cRpiAudioDecoder::WriteData(const unsigned char *buf, unsigned int length,
+		int64_t pts)
+{
+	// no locking needed, since the parser is a single producer, single
+	// consumer queue. Wake up decoder thread only if it's waiting for data.
+	bool ret = m_parser->Append(buf, pts, length);
+	if (ret && __atomic_load_n(&m_sleeping, __ATOMIC_SEQ_CST))
+		m_wait->Signal();
+
+	return ret;
+}
+
+void cRpiAudioDecoder::Reset(void)
+{
+	Lock();
+	uint64_t start = NowUs();
+
+	// request reset and wait until decoder thread has serviced it
+	m_ackMutex->Lock();
+	unsigned int request =
+			__atomic_add_fetch(&m_resetRequest, 1, __ATOMIC_RELEASE);
+	m_wait->Signal();
+	while (m_resetAck != request && !m_stopped)
+		m_ack->Wait(*m_ackMutex);
+	m_ackMutex->Unlock();
+
+	// Reset() is serialized, so the timings have a single writer
+	unsigned int us = NowUs() - start;
+	__atomic_store_n(&m_stageStats.resetTime, us, __ATOMIC_RELAXED);
+	if (us > m_stageStats.resetMax)
+		__atomic_store_n(&m_stageStats.resetMax, us, __ATOMIC_RELAXED);
+
+	syslog(LOG_DEBUG, "[cRpiAudioDecoder] reset done after %dus", us);
+	Unlock();
+}
+
+bool cRpiAudioDecoder::Poll(void)
+{
+	return m_parser->GetFreeSpace() > KILOBYTE(16);
+}
+
+void cRpiAudioDecoder::SetCodecHint(cAudioCodec::eCodec codec)
+{
+	// applied by decoder thread, since the parser is owned by it
+	__atomic_store_n(&m_codecHint, codec, __ATOMIC_RELAXED);
+}
+
+void cRpiAudioDecoder::SetVolume(int vol)
+{
+	m_render->SetVolume(vol);
+}
+
+void cRpiAudioDecoder::SetMute(bool mute)
+{
+	m_render->SetMute(mute);
+}
+
+bool cRpiAudioDecoder::IsVolumeCapable(void)
+{
+	return m_render->IsVolumeCapable();
+}
+
+void cRpiAudioDecoder::GetResyncStats(ResyncStats &stats)
+{
+	m_parser->GetResyncStats(stats);
+}
+
+void cRpiAudioDecoder::GetStageStats(StageStats &stats)
+{
+	stats.decodedFrames = __atomic_load_n(&m_stageStats.decodedFrames, __ATOMIC_RELAXED);
+	stats.decodeTime = __atomic_load_n(&m_stageStats.decodeTime, __ATOMIC_RELAXED);
+	stats.decodeMax = __atomic_load_n(&m_stageStats.decodeMax, __ATOMIC_RELAXED);
+	stats.renderedFrames = __atomic_load_n(&m_stageStats.renderedFrames, __ATOMIC_RELAXED);
+	stats.renderTime = __atomic_load_n(&m_stageStats.renderTime, __ATOMIC_RELAXED);
+	stats.renderMax = __atomic_load_n(&m_stageStats.renderMax, __ATOMIC_RELAXED);
+	stats.parserPasses = __atomic_load_n(&m_stageStats.parserPasses, __ATOMIC_RELAXED);
+	stats.renderLocks = __atomic_load_n(&m_stageStats.renderLocks, __ATOMIC_RELAXED);
+	stats.wakeups = __atomic_load_n(&m_stageStats.wakeups, __ATOMIC_RELAXED);
+	stats.wakeupDelayMax = __atomic_load_n(&m_stageStats.wakeupDelayMax, __ATOMIC_RELAXED);
+	stats.resetTime = __atomic_load_n(&m_stageStats.resetTime, __ATOMIC_RELAXED);
+	stats.resetMax = __atomic_load_n(&m_stageStats.resetMax, __ATOMIC_RELAXED);
+	stats.sampleBuffers = m_pool->GetNumAllocated();
+	stats.defaultBuffers = m_pool->GetNumFallbacks();
+	stats.switchGap = m_render->GetSwitchGap();
+	stats.audioBuffers = m_render->GetNumBuffers();
+	stats.resamplerTime = m_render->GetResamplerTime();
+}
+
+void cRpiAudioDecoder::GetCodecStats(cAudioCodec::eCodec codec,
+		CodecStats &stats)
+{
+	if (codec < 0 || codec >= cAudioCodec::eNumCodecs)
+	{
+		memset(&stats, 0, sizeof(stats));
+		return;
+	}
+
+	const CodecStats &s = m_codecStats[codec].stats;
+	stats.frames = __atomic_load_n(&s.frames, __ATOMIC_RELAXED);
+	stats.framesPerSecond = __atomic_load_n(&s.framesPerSecond, __ATOMIC_RELAXED);
+	for (int i = 0; i < eHistogramSize; i++)
+	{
+		stats.decodeTime[i] = __atomic_load_n(&s.decodeTime[i], __ATOMIC_RELAXED);
+		stats.convertTime[i] = __atomic_load_n(&s.convertTime[i], __ATOMIC_RELAXED);
+		stats.latency[i] = __atomic_load_n(&s.latency[i], __ATOMIC_RELAXED);
+	}
+}
+
+// Counts a frame decoded or passed through and updates the codec's frame
+// rate once per second.
+
+void cRpiAudioDecoder::CountFrame(cAudioCodec::eCodec codec)
+{
+	CodecCounters &counters = m_codecStats[codec];
+	AddCount(counters.stats.frames, 1U);
+	counters.windowFrames++;
+
+	uint64_t now = cTimeMs::Now();
+	if (now - counters.windowStart >= 1000)
+	{
+		__atomic_store_n(&counters.stats.framesPerSecond,
+				now - counters.windowStart < 2000 ? counters.windowFrames *
+						1000 / (unsigned int)(now - counters.windowStart) : 0,
+				__ATOMIC_RELAXED);
+		counters.windowStart = now;
+		counters.windowFrames = 0;
+	}
+}
+
+// Compares the time spent for decoding with the duration of the decoded audio
+// and reduces decoding quality step by step, if decoding takes too large a
+// share of real time for a while.
+
+void cRpiAudioDecoder::GovernLoad(cAudioCodec::eCodec codec,
+		unsigned int decodeTime, unsigned int duration)
+{
+	int limit = cRpiSetup::GetAudioDecodeLoad();
+	if (limit <= 0)
+	{
+		if (m_load.level != eLoadNormal)
+		{
+			m_load.level = eLoadNormal;
+			ApplyLoadLevel(codec);
+		}
+		return;
+	}
+
+	m_load.decodeTime += decodeTime;
+	m_load.duration += duration;
+	if (m_load.duration < AUDIO_LOAD_WINDOW)
+		return;
+
+	int load = m_load.decodeTime * 100 / m_load.duration;
+	m_load.decodeTime = 0;
+	m_load.duration = 0;
+
+	if (load > limit)
+	{
+		m_load.low = 0;
+		if (++m_load.high < AUDIO_LOAD_OVERLOAD || m_load.level == eLoadStereo)
+			return;
+
+		if (cTimeMs::Now() - m_load.restored < AUDIO_LOAD_RELAPSE)
+			m_load.recovery = std::min(m_load.recovery * 2,
+					(unsigned int)AUDIO_LOAD_MAX_RECOVERY);
+		m_load.level++;
+	}
+	else if (m_load.level != eLoadNormal && load < limit * 2 / 3)
+	{
+		m_load.high = 0;
+		if (++m_load.low < m_load.recovery)
+			return;
+
+		m_load.restored = cTimeMs::Now();
+		m_load.level--;
+	}
+	else
 	{
-		return m_outChannels;
+		m_load.high = 0;
+		m_load.low = 0;
+		return;
 	}
 
-	bool Ready(void)
-	{
-		if (!m_configured)
-		{
-			// wait until render is ready before applying new settings
-			if (m_running && m_omx->GetAudioLatency())
-				return false;
+	m_load.high = 0;
+	m_load.low = 0;
 
-			ApplyRenderSettings();
-		}
-		return true;
-	}
+	static const char *levels[] = {
+		"full quality", "dynamic range control disabled", "stereo down mix"
+	};
+	syslog(LOG_INFO, "[cRpiAudioDecoder] %s decoding load %d%%, %s",
+			cAudioCodec::Str(codec), load, levels[m_load.level]);
+	ApplyLoadLevel(codec);
+}
 
-private:
+// Applies the current load level to the decoder. At normal load, the decoder
+// is asked to down mix to the render's channels where supported, so its output
+// may be passed to render without resampling.
 
-	cRpiAudioRender(const cRpiAudioRender&);
-	cRpiAudioRender& operator= (const cRpiAudioRender&);
+void cRpiAudioDecoder::ApplyLoadLevel(cAudioCodec::eCodec codec)
+{
+	AVCodecContext *context = m_codecs[codec].context;
+	if (!context)
+		return;
 
-	void ApplyRenderSettings(void)
-	{
-		if (m_running)
-			m_omx->StopAudio();
+	int channels = m_render->GetChannels();
+	if (m_load.level >= eLoadStereo && channels > 2)
+		channels = 2;
 
-		if (m_codec != cAudioCodec::eInvalid)
-		{
-			if (m_port == cRpiAudioPort::eHDMI)
-				cRpiSetup::SetHDMIChannelMapping(m_codec != cAudioCodec::ePCM,
-						m_outChannels);
+#if FF_API_REQUEST_CHANNELS
+	context->request_channels = channels;
+#endif
+	context->request_channel_layout = AV_CH_LAYOUT(channels);
 
-			m_omx->SetupAudioRender(m_codec, m_outChannels, m_port,
-					m_samplingRate, m_frameSize);
+	// dynamic range control of AC-3 and E-AC-3, other decoders don't know
+	// the option
+	av_opt_set_double(context, "drc_scale",
+			m_load.level >= eLoadNoDrc ? 0.0 : 1.0, AV_OPT_SEARCH_CHILDREN);
+}
 
-			syslog(LOG_DEBUG, "[cRpiAudioRender] set %s audio output format to %dch %s, %d.%dkHz%s",
-					cRpiAudioPort::Str(m_port), m_outChannels,
-					cAudioCodec::Str(m_codec),
-					m_samplingRate / 1000, (m_samplingRate % 1000) / 100,
-					m_codec != cAudioCodec::ePCM ? " (pass-through)" : "");
-		}
-		m_running = m_codec != cAudioCodec::eInvalid;
-		m_configured = true;
-	}
+// Decodes a packet into the frame queue. Returns the number of bytes
+// consumed, 0 if the queue is full or a negative value on error.
 
-#ifdef DO_RESAMPLE
-	void ApplyResamplerSettings(void)
+int cRpiAudioDecoder::Decode(cAudioCodec::eCodec codec, AVPacket *packet)
+{
+	AVCodecContext *context = m_codecs[codec].context;
+	if (!context)
+		return -1;
+
+#ifdef HAVE_SEND_RECEIVE
+	// frames still pending in decoder must be received first
+	int ret = ReceiveFrames(codec);
+	if (ret < 0 || m_queue->IsFull())
+		return ret;
+
+	ret = avcodec_send_packet(context, packet);
+	if (ret == AVERROR(EAGAIN))
+		return 0;
+	if (ret < 0)
+		return ret;
+
+	ret = ReceiveFrames(codec);
+	return ret < 0 ? ret : packet->size;
+#else
+	if (m_queue->IsFull())
+		return 0;
+
+	AVFrame *frame = m_queue->Back();
+	int gotFrame = 0;
+	int len = avcodec_decode_audio4(context, frame, &gotFrame, packet);
+	if (len <= 0)
+		return -1;
+
+	// without a frame, the decoder just needs more data
+	if (gotFrame)
 	{
-		swr_free(&m_resample);
-		m_resample = swr_alloc();
-		if (m_resample)
-		{
-			av_opt_set_int(m_resample, "in_sample_rate", m_samplingRate, 0);
-			av_opt_set_int(m_resample, "in_sample_fmt", m_pcmSampleFormat, 0);
-			av_opt_set_int(m_resample, "in_channel_count", m_inChannels, 0);
-			av_opt_set_int(m_resample, "in_channel_layout",
-					AV_CH_LAYOUT(m_inChannels), 0);
-
-			av_opt_set_int(m_resample, "out_sample_rate", m_samplingRate, 0);
-			av_opt_set_int(m_resample, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
-			av_opt_set_int(m_resample, "out_channel_count", m_outChannels, 0);
-			av_opt_set_int(m_resample, "out_channel_layout",
-					AV_CH_LAYOUT(m_outChannels), 0);
-
-			swr_init(m_resample);
-			m_resamplerConfigured = true;
-		}
-		else
-			syslog(LOG_ERR, "[cRpiAudioRender] failed to allocate resampling context!");
+		frame->pts = packet->pts;
+		m_queue->Push(codec);
+		CountFrame(codec);
 	}
+	return len;
 #endif
+}
 
-	cMutex		        *m_mutex;
-	cOmx		        *m_omx;
+// Moves all frames available from decoder to the queue, as long as there's
+// space left. Returns 0 on success or a negative value on error.
 
-	cRpiAudioPort::ePort m_port;
-	cAudioCodec::eCodec  m_codec;
-	unsigned int         m_inChannels;
-	unsigned int         m_outChannels;
-	unsigned int         m_samplingRate;
-	unsigned int         m_frameSize;
-	bool                 m_configured;
-	bool                 m_running;
+int cRpiAudioDecoder::ReceiveFrames(cAudioCodec::eCodec codec)
+{
+#ifdef HAVE_SEND_RECEIVE
+	while (!m_queue->IsFull())
+	{
+		int ret = avcodec_receive_frame(m_codecs[codec].context,
+				m_queue->Back());
+		if (ret == AVERROR(EAGAIN))
+			break;
+		if (ret < 0)
+			return ret;
 
-#ifdef DO_RESAMPLE
-	SwrContext          *m_resample;
-	bool                 m_resamplerConfigured;
+		m_queue->Push(codec);
+		CountFrame(codec);
+	}
 #endif
+	return 0;
+}
 
-	AVSampleFormat       m_pcmSampleFormat;
-	int64_t              m_pts;
-};
-
-/* ------------------------------------------------------------------------- */
+// Writes queued frames to the render as long as it accepts them, either from
+// the decoder or the render thread. Returns true if any frame was written.
 
-cRpiAudioDecoder::cRpiAudioDecoder(cOmx *omx) :
-	cThread("audio decoder"),
-	m_passthrough(false),
-	m_reset(false),
-	m_setupChanged(true),
-	m_wait(new cCondWait()),
-	m_parser(new cParser()),
-	m_render(new cRpiAudioRender(omx))
+bool cRpiAudioDecoder::WriteFrames(void)
 {
-	memset(m_codecs, 0, sizeof(m_codecs));
-}
+	// queue indices can be read without lock, don't lock the render for
+	// every wake-up with nothing to write, e.g. on appended data
+	if (m_queue->IsEmpty())
+		return false;
 
-cRpiAudioDecoder::~cRpiAudioDecoder()
-{
-	if (Active())
-		Reset();
+	cCountingMutexLock lock(m_renderMutex, m_stageStats.renderLocks);
+	bool written = false;
 
-	delete m_render;
-	delete m_parser;
-	delete m_wait;
+	while (!m_queue->IsEmpty() && m_render->Ready())
+	{
+		AVFrame *frame = m_queue->Front();
+		uint64_t start = NowUs();
+		// frames which failed to be converted are dropped by the render
+		if (!m_render->WriteSamples(frame->extended_data, frame->nb_samples,
+				frame->pts == AV_NOPTS_VALUE ? OMX_INVALID_PTS : frame->pts,
+				(AVSampleFormat)frame->format, frame->channels,
+				frame->channel_layout))
+			break;
+
+		CodecStats &stats = m_codecStats[m_queue->FrontCodec()].stats;
+		AddHistogram(stats.convertTime, AddStageTime(
+				m_stageStats.renderedFrames, m_stageStats.renderTime,
+				m_stageStats.renderMax, start));
+		AddHistogram(stats.latency, start - m_queue->FrontTime());
+		m_queue->Pop();
+		written = true;
+	}
+	return written;
 }
 
-int cRpiAudioDecoder::Init(void)
+bool cRpiAudioDecoder::OpenCodec(cAudioCodec::eCodec codec,
+		const uint8_t *extraData, unsigned int extraDataSize)
 {
-	int ret = m_parser->Init();
-	if (ret)
-		return ret;
+	if (m_codecs[codec].context)
+		return true;
 
-	avcodec_register_all();
+	if (!m_codecs[codec].codec)
+	{
+		syslog(LOG_ERR, "[cRpiAudioDecoder] no %s decoder available!",
+				cAudioCodec::Str(codec));
+		return false;
+	}
 
-	m_codecs[cAudioCodec::ePCM     ].codec = NULL;
-	m_codecs[cAudioCodec::eMPG     ].codec = avcodec_find_decoder(AV_CODEC_ID_MP3);
-	m_codecs[cAudioCodec::eAC3     ].codec = avcodec_find_decoder(AV_CODEC_ID_AC3);
-	m_codecs[cAudioCodec::eEAC3    ].codec = avcodec_find_decoder(AV_CODEC_ID_EAC3);
-	m_codecs[cAudioCodec::eAAC     ].codec = avcodec_find_decoder(AV_CODEC_ID_AAC);
-#ifdef ENABLE_AAC_LATM
-	m_codecs[cAudioCodec::eAAC_LATM].codec = avcodec_find_decoder(AV_CODEC_ID_AAC_LATM);
-#endif
-	m_codecs[cAudioCodec::eDTS     ].codec = avcodec_find_decoder(AV_CODEC_ID_DTS);
+	cTimeMs timer;
+	m_codecs[codec].context = avcodec_alloc_context3(m_codecs[codec].codec);
+	if (!m_codecs[codec].context)
+	{
+		syslog(LOG_ERR, "[cRpiAudioDecoder] failed to allocate %s context!",
+				cAudioCodec::Str(codec));
+		return false;
+	}
 
-	for (int i = 0; i < cAudioCodec::eNumCodecs; i++)
+	// decoders supporting several sample formats should prefer the render's
+	m_codecs[codec].context->request_sample_fmt = AV_SAMPLE_FMT_S16;
+
+	if (extraData)
 	{
-		cAudioCodec::eCodec codec = static_cast<cAudioCodec::eCodec>(i);
-		if (m_codecs[codec].codec)
+		m_codecs[codec].context->extradata = (uint8_t *)av_mallocz(
+				extraDataSize + AV_INPUT_BUFFER_PADDING_SIZE);
+		if (m_codecs[codec].context->extradata)
 		{
-			m_codecs[codec].context = avcodec_alloc_context3(m_codecs[codec].codec);
-			if (!m_codecs[codec].context)
-			{
-				syslog(LOG_ERR, "[cRpiAudioDecoder] failed to allocate %s context!", cAudioCodec::Str(codec));
-				ret = -1;
-				break;
-			}
-			if (avcodec_open2(m_codecs[codec].context, m_codecs[codec].codec, NULL) < 0)
-			{
-				syslog(LOG_ERR, "[cRpiAudioDecoder] failed to open %s decoder!", cAudioCodec::Str(codec));
-				ret = -1;
-				break;
-			}
+			memcpy(m_codecs[codec].context->extradata, extraData,
+					extraDataSize);
+			m_codecs[codec].context->extradata_size = extraDataSize;
 		}
 	}
 
-	if (!ret)
+#ifdef HAVE_GET_BUFFER2
+	// decoded frames are queued, so they need to be reference counted and
+	// should use recycled sample buffers
+	m_codecs[codec].context->get_buffer2 = &cBufferPool::GetBuffer;
+	m_codecs[codec].context->opaque = m_pool;
+#ifndef HAVE_SEND_RECEIVE
+	m_codecs[codec].context->refcounted_frames = 1;
+#endif
+#endif
+
+	if (avcodec_open2(m_codecs[codec].context, m_codecs[codec].codec, NULL) < 0)
 	{
-		cRpiSetup::SetAudioSetupChangedCallback(&OnAudioSetupChanged, this);
-		Start();
+		syslog(LOG_ERR, "[cRpiAudioDecoder] failed to open %s decoder!",
+				cAudioCodec::Str(codec));
+		av_freep(&m_codecs[codec].context->extradata);
+		avcodec_free_context(&m_codecs[codec].context);
+		return false;
 	}
-	else
-		DeInit();
+	m_codecs[codec].lastUsed = cTimeMs::Now();
 
-	return ret;
+	syslog(LOG_DEBUG, "[cRpiAudioDecoder] opened %s decoder in %dms",
+			cAudioCodec::Str(codec), (int)timer.Elapsed());
+	return true;
 }
 
-int cRpiAudioDecoder::DeInit(void)
+void cRpiAudioDecoder::CloseCodec(cAudioCodec::eCodec codec)
 {
-	Lock();
+	if (!m_codecs[codec].context)
+		return;
 
-	Reset();
-	Cancel(-1);
-	m_wait->Signal();
+	avcodec_close(m_codecs[codec].context);
+	av_freep(&m_codecs[codec].context->extradata);
+	avcodec_free_context(&m_codecs[codec].context);
+}
 
-	while (Active())
-		cCondWait::SleepMs(5);
+// Opens one decoder in advance if prewarming is enabled and releases idle
+// decoders. Returns true if a decoder has been opened.
 
-	m_render->Flush();
-	cRpiSetup::SetAudioSetupChangedCallback(0);
+bool cRpiAudioDecoder::ManageCodecs(cAudioCodec::eCodec current)
+{
+	uint64_t now = cTimeMs::Now();
+	if (current != cAudioCodec::eInvalid)
+		m_codecs[current].lastUsed = now;
 
-	for (int i = 0; i < cAudioCodec::eNumCodecs; i++)
+	// one decoder per call, so new data won't be delayed too much
+	while (m_prewarm < cAudioCodec::eNumCodecs)
 	{
-		cAudioCodec::eCodec codec = static_cast<cAudioCodec::eCodec>(i);
-		if (m_codecs[codec].codec)
-			avcodec_close(m_codecs[codec].context);
+		cAudioCodec::eCodec codec = static_cast<cAudioCodec::eCodec>(m_prewarm++);
+		if (m_codecs[codec].codec && !m_codecs[codec].context)
+		{
+			OpenCodec(codec);
+			return true;
+		}
 	}
 
-	av_log_set_callback(&av_log_default_callback);
-	m_parser->DeInit();
+	bool lowMemory = false;
+	if (now >= m_nextMemoryCheck)
+	{
+		struct sysinfo info;
+		if (!sysinfo(&info))
+			lowMemory = (uint64_t)(info.freeram + info.bufferram) *
+					info.mem_unit < (uint64_t)AVCODEC_LOW_MEMORY;
+		m_nextMemoryCheck = now + AVCODEC_MEMORY_CHECK;
+	}
 
-	Unlock();
-	return 0;
+	for (int i = 0; i < cAudioCodec::eNumCodecs; i++)
+	{
+		cAudioCodec::eCodec codec = static_cast<cAudioCodec::eCodec>(i);
+		if (codec == current || !m_codecs[codec].context)
+			continue;
+
+		// prewarmed decoders are only released if memory is low
+		bool release = lowMemory;
+#ifndef AUDIO_DECODER_PREWARM
+		release |= now - m_codecs[codec].lastUsed > AVCODEC_IDLE_RELEASE;
+#endif
+		if (release)
+		{
+			syslog(LOG_DEBUG, "[cRpiAudioDecoder] releasing idle %s decoder",
+					cAudioCodec::Str(codec));
+			CloseCodec(codec);
+		}
+	}
+	return false;
 }
 
-bool cRpiAudioDecoder::WriteData(const unsigned char *buf, unsigned int length,
-		int64_t pts)
+int cRpiAudioDecoder::SetExtraData(cAudioCodec::eCodec codec,
+		const uint8_t *data, unsigned int size)
 {
-	Lock();
-
-	bool ret = m_parser->Append(buf, pts, length);
-	if (ret)
-		m_wait->Signal();
-
-	Unlock();
-	return ret;
+	// extradata is only evaluated when opening the decoder, so a new one
+	// is opened, leaving the codec closed if that fails
+	CloseCodec(codec);
+	if (!OpenCodec(codec, data, size))
+	{
+		syslog(LOG_ERR, "[cRpiAudioDecoder] failed to re-open %s decoder!",
+				cAudioCodec::Str(codec));
+		return -1;
+	}
+	ApplyLoadLevel(codec);
+	return 0;
 }
 
-void cRpiAudioDecoder::Reset(void)
+void cRpiAudioDecoder::HandleAudioSetupChanged()
 {
-	Lock();
-	m_reset = true;
+	syslog(LOG_DEBUG, "[cRpiAudioDecoder] HandleAudioSetupChanged()");
+	m_setupChanged = true;
 	m_wait->Signal();
-	while (m_reset)
-		cCondWait::SleepMs(5);
-	Unlock();
 }
 
-bool cRpiAudioDecoder::Poll(void)
+void cRpiAudioDecoder::Acknowledge(unsigned int resetRequest, bool stopped)
 {
-	return m_parser->GetFreeSpace() > KILOBYTE(16);
+	m_ackMutex->Lock();
+	m_resetAck = resetRequest;
+	m_stopped = stopped;
+	m_ack->Broadcast();
+	m_ackMutex->Unlock();
 }
 
-void cRpiAudioDecoder::HandleAudioSetupChanged()
+void cRpiAudioDecoder::HandleAudioBufferEmptied()
 {
-	syslog(LOG_DEBUG, "[cRpiAudioDecoder] HandleAudioSetupChanged()");
-	m_setupChanged = true;
+	// same as for new data, wake up decoder thread only if it's waiting
+	__atomic_store_n(&m_bufferEventTime, NowUs(), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&m_bufferEvents, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&m_sleeping, __ATOMIC_SEQ_CST))
+		m_wait->Signal();
+	if (m_renderThread)
+		m_renderThread->Wakeup();
 }
 
 void cRpiAudioDecoder::Action(void)
 {
-	SetPriority(-15);
-	syslog(LOG_DEBUG, "[cRpiAudioDecoder] cAudioDecoder() thread started");
+	SetPriority(cRpiSetup::GetAudioDecoderPriority());
+	SetAffinity(cRpiSetup::GetAudioDecoderCpu());
+	syslog(LOG_DEBUG, "[cRpiAudioDecoder] cAudioDecoder() thread started%s",
+			m_renderThread ? ", render runs in separate thread" : "");
 
 	unsigned int channels = 0;
 	unsigned int samplingRate = 0;
 	cAudioCodec::eCodec codec = cAudioCodec::eInvalid;
+	cParser::Frame frames[AVPKT_FRAME_BATCH];
 
-	AVFrame *frame = av_frame_alloc();
-	if (!frame)
-	{
-		syslog(LOG_ERR, "[cRpiAudioDecoder] failed to allocate audio frame!");
-		return;
-	}
+	// LATM frames are demultiplexed here to feed the plain AAC decoder
+	cRpiLatmDemux latm;
+	unsigned int latmConfig = 0;
+	unsigned int latmOffset = 0;
+
+#ifdef DEBUG_BUFFERSTAT
+	unsigned int lastWakeups = 0;
+	cTimeMs statTimer(10000);
+#endif
 
 	while (Running())
 	{
-		if (m_reset)
+		// audio buffers returned by render so far
+		unsigned int bufferEvents =
+				__atomic_load_n(&m_bufferEvents, __ATOMIC_SEQ_CST);
+
+		// frames taken from queue by render so far
+		unsigned int readIndex = m_queue->ReadIndex();
+
+		// either requested by Reset() or internally
+		unsigned int resetRequest =
+				__atomic_load_n(&m_resetRequest, __ATOMIC_ACQUIRE);
+		if (m_reset || resetRequest != m_resetAck)
 		{
+			cCountingMutexLock lock(m_renderMutex, m_stageStats.renderLocks);
 			m_parser->Reset();
 			m_render->Flush();
-			av_frame_unref(frame);
+			m_queue->Clear();
+			if (codec != cAudioCodec::eInvalid && m_codecs[codec].context)
+				avcodec_flush_buffers(m_codecs[codec].context);
 			m_reset = false;
+			latmOffset = 0;
+
+			if (resetRequest != m_resetAck)
+				Acknowledge(resetRequest);
 		}
 
-		// test for codec change if there is data in parser and no left over
-		if (!m_parser->Empty() && !frame->nb_samples)
-			m_setupChanged |= codec != m_parser->GetCodec() ||
-				channels != m_parser->GetChannels() ||
-				samplingRate != m_parser->GetSamplingRate();
+		// pass decoded audio data to render when ready, unless done by
+		// render thread
+		bool progress = !m_renderThread && WriteFrames();
+
+		m_parser->SetCodecHint(__atomic_load_n(&m_codecHint, __ATOMIC_RELAXED));
+		unsigned int count = m_parser->GetFrames(frames, AVPKT_FRAME_BATCH);
+		AddCount(m_stageStats.parserPasses, 1U);
+
+		// test for codec change if there is data in parser. Frames of the
+		// previous setup still queued need to be written to render first.
+		bool changed = count && (codec != frames[0].codec ||
+				channels != frames[0].channels ||
+				samplingRate != frames[0].samplingRate);
 
 		// if necessary, set up audio codec
-		if (!m_parser->Empty() && m_setupChanged)
+		if (count && (changed || m_setupChanged) && m_queue->IsEmpty())
 		{
-			if (codec != m_parser->GetCodec() && codec != cAudioCodec::eInvalid)
-				avcodec_flush_buffers(m_codecs[codec].context);
+			cCountingMutexLock lock(m_renderMutex, m_stageStats.renderLocks);
+			if (codec != frames[0].codec)
+			{
+				if (codec != cAudioCodec::eInvalid &&
+						m_codecs[codec].context)
+					avcodec_flush_buffers(m_codecs[codec].context);
+
+				// decoder may have been released in the meantime
+				latmConfig = 0;
+				latmOffset = 0;
+			}
 
-			codec = m_parser->GetCodec();
-			channels = m_parser->GetChannels();
-			samplingRate = m_parser->GetSamplingRate();
+			// output formats selected so far may not be valid anymore
+			if (m_setupChanged)
+				m_render->ClearSetupCache();
+
+			codec = frames[0].codec;
+			channels = frames[0].channels;
+			samplingRate = frames[0].samplingRate;
 
 			// validate channel layout and apply new audio parameters
-			if (AV_CH_LAYOUT(channels))
+			if (AV_CH_LAYOUT(frames[0].coreChannels))
 			{
 				m_setupChanged = false;
-				m_render->SetCodec(codec, channels, samplingRate,
-						m_parser->GetFrameSize());
-
-#ifndef DO_RESAMPLE
-#if FF_API_REQUEST_CHANNELS
-				// if there's no libswresample, let decoder do the down mix
-				m_codecs[codec].context->request_channels =
-						m_render->GetChannels();
-#endif
-				m_codecs[codec].context->request_channel_layout =
-						AV_CH_LAYOUT(m_render->GetChannels());
+				m_render->SetCodec(codec, channels, frames[0].coreChannels,
+						samplingRate, frames[0].size, frames[0].coreSize);
+
+				// open decoder on first use, unless passed through. Without
+				// decoder, frames are dropped by Decode().
+				if (!m_render->IsPassthrough() && OpenCodec(codec))
+					ApplyLoadLevel(codec);
+
+				m_load.decodeTime = 0;
+				m_load.duration = 0;
+#ifdef HAVE_GET_BUFFER2
+				m_queue->SetMaxDuration(cRpiSetup::GetAudioDecodeAhead());
+#else
+				// frames are owned by decoder, so only one can be queued
+				m_queue->SetMaxDuration(0);
 #endif
 			}
+			else
+				m_setupChanged = true;
+
 			m_reset = m_setupChanged;
 			continue;
 		}
+		if (changed || m_setupChanged)
+			count = 0;
 
-		// if there's audio data available...
-		if (!m_parser->Empty())
+		// process as many of the available frames as possible and release
+		// the consumed data afterwards at once
+		unsigned int consumed = 0;
+		for (unsigned int i = 0; i < count; i++)
 		{
-			// ... either pass through if render is ready
+			int len = 0;
+
+			// either pass through if render is ready...
 			if (m_render->IsPassthrough())
 			{
-				if (m_render->Ready())
+				cCountingMutexLock lock(m_renderMutex, m_stageStats.renderLocks);
+				if (!m_render->Ready())
+					break;
+
+				// drop extensions not supported by sink
+				bool coreOnly = m_render->IsCoreOnly();
+				len = m_render->WriteSamples(&frames[i].data, coreOnly ?
+						frames[i].coreSize : frames[i].size, frames[i].pts);
+				if (coreOnly && len == (int)frames[i].coreSize)
+					len = frames[i].size;
+				if (len == (int)frames[i].size)
+					CountFrame(codec);
+			}
+			// ... or decode ahead as long as there's space in the queue
+			else
+			{
+				// decode core only, extensions are just needed for
+				// pass-through. Frames are copied for zeroed padding, LATM
+				// payload is demultiplexed to a padded buffer anyway.
+				AVPacket packet;
+				av_init_packet(&packet);
+				packet.data = codec == cAudioCodec::eAAC_LATM ? frames[i].data :
+						m_parser->GetPacket(frames[i].data, frames[i].coreSize);
+				packet.size = frames[i].coreSize;
+				packet.pts = frames[i].pts;
+
+				// for LATM, decode the raw access unit and re-open decoder
+				// with new AudioSpecificConfig when StreamMuxConfig changed
+				if (codec == cAudioCodec::eAAC_LATM)
 				{
-					int len = m_render->WriteSamples(&m_parser->Packet()->data,
-							m_parser->Packet()->size, m_parser->GetPts());
-					if (len)
+					if (!latm.Parse(frames[i].data, frames[i].size, true))
+						packet.size = 0;
+					else
 					{
-						m_parser->Shrink(len);
-						continue;
+						if (latm.GetConfigVersion() != latmConfig)
+						{
+							latmConfig = latm.GetConfigVersion();
+							if (SetExtraData(codec, latm.GetConfig(),
+									latm.GetConfigSize()))
+								latmConfig = 0;
+						}
+						// continue a partially decoded access unit
+						packet.data = latm.GetPayload() + latmOffset;
+						packet.size = latmConfig && latmOffset <
+								latm.GetPayloadSize() ?
+								latm.GetPayloadSize() - latmOffset : 0;
 					}
 				}
-			}
-			// ... or decode if there's no leftover
-			else if (!frame->nb_samples)
-			{
-				int gotFrame = 0;
-				int len = avcodec_decode_audio4(m_codecs[codec].context,
-						frame, &gotFrame, m_parser->Packet());
 
-				if (len > 0 && gotFrame)
+				uint64_t start = NowUs();
+				uint64_t decoded = m_queue->GetDecodedDuration();
+				len = packet.size ? Decode(codec, &packet) : -1;
+				if (!len)
+					break;
+
+				unsigned int decodeTime = AddStageTime(
+						m_stageStats.decodedFrames, m_stageStats.decodeTime,
+						m_stageStats.decodeMax, start);
+				AddHistogram(m_codecStats[codec].stats.decodeTime, decodeTime);
+				GovernLoad(codec, decodeTime,
+						m_queue->GetDecodedDuration() - decoded);
+				if (m_renderThread)
+					m_renderThread->Wakeup();
+
+				if (len > 0)
 				{
-					frame->pts = m_parser->GetPts();
-					m_parser->Shrink(len);
+					// the LOAS frame is kept until its access unit has been
+					// consumed completely, as the consumed length refers to
+					// the demultiplexed payload
+					if (codec == cAudioCodec::eAAC_LATM && len < packet.size)
+					{
+						latmOffset += len;
+						len = 0;
+						progress = true;
+					}
+					else
+					{
+						latmOffset = 0;
+						if (len == packet.size)
+							len = frames[i].size;
+					}
 				}
 				else
 				{
 					syslog(LOG_ERR, "[cRpiAudioDecoder] failed to decode audio frame!");
 					m_parser->Reset();
-					av_frame_unref(frame);
-					continue;
+					latmOffset = 0;
+					if (m_codecs[codec].context)
+						avcodec_flush_buffers(m_codecs[codec].context);
+					consumed = 0;
+					progress = true;
+					break;
 				}
 			}
+
+			consumed += len;
+
+			// following frames are only valid if the whole frame has been
+			// consumed, otherwise they need to be parsed again
+			if (len != (int)frames[i].size)
+				break;
+		}
+
+		if (consumed)
+		{
+			m_parser->Shrink(consumed);
+			progress = true;
+		}
+		if (progress)
+			continue;
+
+		// use idle time to open or release decoders
+		if (ManageCodecs(codec))
+			continue;
+
+		// nothing to be done, wait for new data, a free audio buffer, the
+		// render to get drained or the packed PCM buffer to be due. Data and
+		// buffers signal their arrival, so there's no need to poll.
+		unsigned int timeout;
+		{
+			cCountingMutexLock lock(m_renderMutex, m_stageStats.renderLocks);
+			timeout = m_render->Poll();
 		}
-		// if there's leftover, pass decoded audio data to render when ready
-		if (frame->nb_samples && m_render->Ready())
+		__atomic_store_n(&m_sleeping, true, __ATOMIC_SEQ_CST);
+		if (!m_parser->HasNewData() && bufferEvents ==
+				__atomic_load_n(&m_bufferEvents, __ATOMIC_SEQ_CST) &&
+				readIndex == m_queue->ReadIndex())
 		{
-			int len = m_render->WriteSamples(frame->extended_data,
-					frame->nb_samples, frame->pts,
-					(AVSampleFormat)frame->format);
-			if (len)
+			m_wait->Wait(timeout);
+			AddCount(m_stageStats.wakeups, 1U);
+
+			// latency from the render to the decoder thread refilling it
+			if (bufferEvents !=
+					__atomic_load_n(&m_bufferEvents, __ATOMIC_SEQ_CST))
 			{
-				av_frame_unref(frame);
-				continue;
+				unsigned int delay = NowUs() -
+						__atomic_load_n(&m_bufferEventTime, __ATOMIC_RELAXED);
+				if (delay > m_stageStats.wakeupDelayMax)
+					__atomic_store_n(&m_stageStats.wakeupDelayMax, delay,
+							__ATOMIC_RELAXED);
 			}
 		}
-		// nothing to be done...
-		m_wait->Wait(50);
+		__atomic_store_n(&m_sleeping, false, __ATOMIC_RELAXED);
+
+#ifdef DEBUG_BUFFERSTAT
+		if (statTimer.TimedOut())
+		{
+			syslog(LOG_DEBUG, "[cRpiAudioDecoder] %d wake-ups/s, "
+					"max. %dus from buffer emptied to wake-up",
+					(m_stageStats.wakeups - lastWakeups) / 10,
+					m_stageStats.wakeupDelayMax);
+			lastWakeups = m_stageStats.wakeups;
+			statTimer.Set(10000);
+		}
+#endif
 	}
 
-	av_frame_free(&frame);
+	{
+		cCountingMutexLock lock(m_renderMutex, m_stageStats.renderLocks);
+		m_queue->Clear();
+	}
 	syslog(LOG_DEBUG, "[cRpiAudioDecoder] cAudioDecoder() thread ended");
+
+	// release all pending and further Reset() calls and DeInit()
+	Acknowledge(__atomic_load_n(&m_resetRequest, __ATOMIC_ACQUIRE), true);
 }
 
 void cRpiAudioDecoder::Log(void* ptr, int level, const char* fmt, va_list vl)
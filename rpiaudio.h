@@ -29,6 +29,39 @@ class cRpiAudioDecoder : public cThread
 
 public:
 
+	struct ResyncStats
+	{
+		unsigned int resyncs;		// number of times sync has been lost
+		unsigned int skippedBytes;	// bytes skipped to find a valid frame
+		unsigned int resyncTime;	// time spent without sync in ms
+	};
+
+	struct StageStats
+	{
+		unsigned int decodedFrames;	// frames passed to decoder
+		uint64_t	 decodeTime;	// time spent decoding in us
+		unsigned int decodeMax;		// longest decode of a frame in us
+		unsigned int renderedFrames;// decoded frames written to render
+		uint64_t	 renderTime;	// time spent writing to render in us
+		unsigned int renderMax;		// longest write of a frame in us
+		unsigned int parserPasses;	// frame batches fetched from parser
+		unsigned int renderLocks;	// render locks by decoder and render
+									// thread, lock operations per frame
+									// are this over decodedFrames, 0
+									// without AUDIO_RENDER_THREAD
+		unsigned int wakeups;		// decoder thread wake-ups from sleep
+		unsigned int wakeupDelayMax;// longest time from an emptied audio
+									// buffer to decoder running in us
+		unsigned int resetTime;		// last Reset(), e.g. on zapping, in us
+		unsigned int resetMax;		// longest Reset() in us
+		unsigned int sampleBuffers;	// recycled sample buffers allocated
+		unsigned int defaultBuffers;// frames allocated by libav instead
+		unsigned int switchGap;		// last gap in audio output after a
+									// reset or new setup in ms
+		unsigned int audioBuffers;	// OMX buffers written to render
+		unsigned int resamplerTime;	// last resampler reconfiguration in us
+	};
+
     cRpiAudioDecoder(cOmx *omx);
 	virtual ~cRpiAudioDecoder();
 
@@ -41,6 +74,42 @@ public:
 	virtual bool Poll(void);
 	virtual void Reset(void);
 
+	// If the audio codec is known in advance, e.g. from the PMT, the parser
+	// only searches for frames of this codec to speed up resync and avoid
+	// false sync hits in other codecs' payload. eInvalid disables the hint.
+	virtual void SetCodecHint(cAudioCodec::eCodec codec);
+
+	// Volume (0..255) and mute are applied to decoded audio in software,
+	// since the OMX render doesn't support them. Pass-through audio isn't
+	// volume capable.
+	virtual void SetVolume(int vol);
+	virtual void SetMute(bool mute);
+	virtual bool IsVolumeCapable(void);
+
+	virtual void GetResyncStats(ResyncStats &stats);
+
+	// timing of the decode and render stage since Init()
+	virtual void GetStageStats(StageStats &stats);
+
+	// Histograms count durations in us in buckets of powers of two: bucket 0
+	// holds durations below 1us, bucket i those in [2^(i-1), 2^i) and the
+	// last bucket all longer ones.
+	enum { eHistogramSize = 20 };
+
+	struct CodecStats
+	{
+		unsigned int frames;			// decoder output or passed through
+		unsigned int framesPerSecond;	// during the last second of activity
+		unsigned int decodeTime[eHistogramSize];	// per decoder call
+		unsigned int convertTime[eHistogramSize];	// conversion and writing
+													// to render per frame
+		unsigned int latency[eHistogramSize];		// decoded to written
+	};
+
+	// per codec statistics since Init(), collected at the cost of a few
+	// plain counter increments per frame
+	virtual void GetCodecStats(cAudioCodec::eCodec codec, CodecStats &stats);
+
 protected:
 
 	virtual void Action(void);
@@ -50,26 +119,104 @@ protected:
 
 	void HandleAudioSetupChanged();
 
+	static void OnAudioBufferEmptied(void *data)
+		{ (static_cast <cRpiAudioDecoder*> (data))->HandleAudioBufferEmptied(); }
+
+	void HandleAudioBufferEmptied();
+
+	void Acknowledge(unsigned int resetRequest, bool stopped = false);
+
+	int Decode(cAudioCodec::eCodec codec, struct AVPacket *packet);
+	int ReceiveFrames(cAudioCodec::eCodec codec);
+	bool WriteFrames(void);
+
+	bool OpenCodec(cAudioCodec::eCodec codec, const uint8_t *extraData = 0,
+			unsigned int extraDataSize = 0);
+	void CloseCodec(cAudioCodec::eCodec codec);
+	bool ManageCodecs(cAudioCodec::eCodec current);
+
+	int SetExtraData(cAudioCodec::eCodec codec, const uint8_t *data,
+			unsigned int size);
+
+	void CountFrame(cAudioCodec::eCodec codec);
+
+	void GovernLoad(cAudioCodec::eCodec codec, unsigned int decodeTime,
+			unsigned int duration);
+	void ApplyLoadLevel(cAudioCodec::eCodec codec);
+
 	static void Log(void* ptr, int level, const char* fmt, va_list vl);
 
 	struct Codec
 	{
 		class AVCodec		 *codec;
 	    class AVCodecContext *context;
+		uint64_t			  lastUsed;
+	};
+
+	struct CodecCounters
+	{
+		CodecStats	 stats;
+		uint64_t	 windowStart;	// frame rate measurement, only used by
+		unsigned int windowFrames;	// decoder thread
+	};
+
+	// decoding quality is reduced in steps when decoding load is too high
+	enum eLoadLevel
+	{
+		eLoadNormal,
+		eLoadNoDrc,
+		eLoadStereo
+	};
+
+	struct Load
+	{
+		int			 level;
+		uint64_t	 decodeTime;	// in current window, in us
+		uint64_t	 duration;		// of decoded audio, in us
+		unsigned int high;			// consecutive windows above limit
+		unsigned int low;			// consecutive windows below limit
+		unsigned int recovery;		// windows needed to restore a level
+		uint64_t	 restored;		// time of last restore in ms
 	};
 
 private:
 
+	// tests and benchmarks, see test/rpiaudiotest.h
+	friend class cRpiAudioTest;
+
 	class cParser;
+	class cFrameQueue;
+	class cRenderThread;
+	class cBufferPool;
 
 	Codec		  	m_codecs[cAudioCodec::eNumCodecs];
 	bool		  	m_passthrough;
 	bool		  	m_reset;
+	unsigned int	m_resetRequest;
+	unsigned int	m_resetAck;
+	bool		  	m_stopped;
 	bool		  	m_setupChanged;
-
+	bool		  	m_sleeping;
+	unsigned int	m_bufferEvents;
+	StageStats		m_stageStats;
+	CodecCounters	m_codecStats[cAudioCodec::eNumCodecs];
+	Load			m_load;
+	uint64_t		m_bufferEventTime;	// last emptied audio buffer in us
+
+	cAudioCodec::eCodec m_codecHint;
+	int				m_prewarm;
+	uint64_t		m_nextMemoryCheck;
+
+	cOmx			*m_omx;
 	cCondWait	 	*m_wait;
+	cMutex			*m_ackMutex;
+	cCondVar		*m_ack;
 	cParser		 	*m_parser;
+	cFrameQueue		*m_queue;
+	cBufferPool		*m_pool;
 	cRpiAudioRender	*m_render;
+	cRenderThread	*m_renderThread;
+	cMutex			*m_renderMutex;
 };
 
 #endif
@@ -0,0 +1,193 @@
+/*
+ * rpihddevice - Enigma2 rpihddevice library for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "rpiaudiodsp.h"
+
+#include <syslog.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(AUDIO_DSP_NEON) && defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+unsigned int (*cRpiAudioDsp::s_findSync)(const uint8_t *p, unsigned int n) =
+		&cRpiAudioDsp::FindSyncC;
+
+void (*cRpiAudioDsp::s_interleave16)(int16_t *dst, const int16_t *const *src,
+		unsigned int channels, unsigned int n, int gain) =
+				&cRpiAudioDsp::Interleave16C;
+
+void (*cRpiAudioDsp::s_convertFlt)(int16_t *dst, const float *const *src,
+		unsigned int channels, unsigned int n, float gain) =
+				&cRpiAudioDsp::ConvertFltC;
+
+void (*cRpiAudioDsp::s_downmix51Flt)(int16_t *dst, const float *const *src,
+		unsigned int n, float gain) = &cRpiAudioDsp::Downmix51FltC;
+
+// 1 / (1 + 2 * sqrt(0.5)) and sqrt(0.5) / (1 + 2 * sqrt(0.5))
+const float cRpiAudioDsp::s_downmixFront = 0.41421356f;
+const float cRpiAudioDsp::s_downmixCenter = 0.29289322f;
+
+void cRpiAudioDsp::Init(void)
+{
+	const char *impl = "C";
+	s_findSync = &FindSyncC;
+	s_interleave16 = &Interleave16C;
+	s_convertFlt = &ConvertFltC;
+	s_downmix51Flt = &Downmix51FltC;
+
+#ifdef __SSE2__
+	impl = "SSE2";
+	s_findSync = &FindSyncSse2;
+#endif
+
+#ifdef AUDIO_DSP_NEON
+	if (HasNeon())
+	{
+		impl = "NEON";
+		s_findSync = &FindSyncNeon;
+		s_interleave16 = &Interleave16Neon;
+		s_convertFlt = &ConvertFltNeon;
+		s_downmix51Flt = &Downmix51FltNeon;
+	}
+#endif
+
+	syslog(LOG_DEBUG, "[cRpiAudioDsp] using %s implementation", impl);
+}
+
+#ifdef AUDIO_DSP_NEON
+bool cRpiAudioDsp::HasNeon(void)
+{
+#if defined(__aarch64__)
+	return true;
+#else
+	return getauxval(AT_HWCAP) & HWCAP_NEON;
+#endif
+}
+#endif
+
+unsigned int cRpiAudioDsp::FindSyncC(const uint8_t *p, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++)
+		if (p[i] == 0xFF || p[i] == 0x0B || p[i] == 0x7F || p[i] == 0x56)
+			return i;
+
+	return n;
+}
+
+void cRpiAudioDsp::Interleave16C(int16_t *dst, const int16_t *const *src,
+		unsigned int channels, unsigned int n, int gain)
+{
+	if (gain < eUnityGain)
+	{
+		for (unsigned int i = 0; i < n; i++)
+			for (unsigned int c = 0; c < channels; c++)
+				*dst++ = (src[c][i] * gain + 0x4000) >> 15;
+		return;
+	}
+
+	// stereo is by far the most common case
+	if (channels == 2)
+	{
+		const int16_t *l = src[0], *r = src[1];
+		for (unsigned int i = 0; i < n; i++)
+		{
+			*dst++ = l[i];
+			*dst++ = r[i];
+		}
+		return;
+	}
+
+	for (unsigned int i = 0; i < n; i++)
+		for (unsigned int c = 0; c < channels; c++)
+			*dst++ = src[c][i];
+}
+
+// rounds a sample scaled to 16 bit half away from zero and clips it
+static inline int16_t FltToS16(float v)
+{
+	if (v >= 32767.0f)
+		return 32767;
+	if (v <= -32768.0f)
+		return -32768;
+	return (int16_t)(v < 0 ? v - 0.5f : v + 0.5f);
+}
+
+void cRpiAudioDsp::ConvertFltC(int16_t *dst, const float *const *src,
+		unsigned int channels, unsigned int n, float gain)
+{
+	float scale = gain * 32768.0f;
+	if (channels == 2)
+	{
+		const float *l = src[0], *r = src[1];
+		for (unsigned int i = 0; i < n; i++)
+		{
+			*dst++ = FltToS16(l[i] * scale);
+			*dst++ = FltToS16(r[i] * scale);
+		}
+		return;
+	}
+
+	for (unsigned int i = 0; i < n; i++)
+		for (unsigned int c = 0; c < channels; c++)
+			*dst++ = FltToS16(src[c][i] * scale);
+}
+
+void cRpiAudioDsp::Downmix51FltC(int16_t *dst, const float *const *src,
+		unsigned int n, float gain)
+{
+	float front = s_downmixFront * gain * 32768.0f;
+	float center = s_downmixCenter * gain * 32768.0f;
+
+	// planes are FL, FR, FC, LFE, BL/SL, BR/SR
+	for (unsigned int i = 0; i < n; i++)
+	{
+		float c = src[2][i] * center;
+		*dst++ = FltToS16(src[0][i] * front + c + src[4][i] * center);
+		*dst++ = FltToS16(src[1][i] * front + c + src[5][i] * center);
+	}
+}
+
+#ifdef __SSE2__
+unsigned int cRpiAudioDsp::FindSyncSse2(const uint8_t *p, unsigned int n)
+{
+	const __m128i ff = _mm_set1_epi8((char)0xFF);
+	const __m128i b0 = _mm_set1_epi8(0x0B);
+	const __m128i f7 = _mm_set1_epi8(0x7F);
+	const __m128i l6 = _mm_set1_epi8(0x56);
+
+	unsigned int i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i m = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, ff), _mm_cmpeq_epi8(v, b0)),
+				_mm_or_si128(_mm_cmpeq_epi8(v, f7), _mm_cmpeq_epi8(v, l6)));
+
+		int mask = _mm_movemask_epi8(m);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + FindSyncC(p + i, n - i);
+}
+#endif
@@ -0,0 +1,107 @@
+/*
+ * rpihddevice - Enigma2 rpihddevice library for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AUDIO_DSP_H
+#define AUDIO_DSP_H
+
+#include <stdint.h>
+
+class cRpiAudioDsp
+{
+
+public:
+
+	// Selects the best implementation of each function for the CPU we're
+	// running on. Must be called before any other function is used.
+	static void Init(void);
+
+	// Returns the offset of the first byte in p[0..n) which may start an
+	// audio frame sync word (0xFF, 0x0B, 0x7F or 0x56), or n if there is none.
+	static unsigned int FindSync(const uint8_t *p, unsigned int n) {
+		return s_findSync(p, n);
+	}
+
+	// gain of 16 bit samples in Q15, samples are left unchanged by any gain
+	// from eUnityGain on
+	enum { eUnityGain = 0x8000 };
+
+	// Interleaves n samples of the given number of 16 bit planes to dst and
+	// applies the given gain. A single plane may be scaled in place.
+	static void Interleave16(int16_t *dst, const int16_t *const *src,
+			unsigned int channels, unsigned int n, int gain = eUnityGain) {
+		s_interleave16(dst, src, channels, n, gain);
+	}
+
+	// Converts n samples of the given number of float planes to interleaved
+	// 16 bit samples, scaled by the given gain, rounded to nearest and
+	// clipped.
+	static void ConvertFlt(int16_t *dst, const float *const *src,
+			unsigned int channels, unsigned int n, float gain = 1.0f) {
+		s_convertFlt(dst, src, channels, n, gain);
+	}
+
+	// Down mixes n samples of 5.1 float planes to interleaved 16 bit stereo,
+	// scaled by the given gain. Center and surround channels are mixed at
+	// -3dB, LFE is dropped and the result is normalized to avoid clipping,
+	// same as libswresample does.
+	static void Downmix51Flt(int16_t *dst, const float *const *src,
+			unsigned int n, float gain = 1.0f) {
+		s_downmix51Flt(dst, src, n, gain);
+	}
+
+private:
+
+	// tests and benchmarks compare the implementations
+	friend class cRpiAudioTest;
+
+	// down mix coefficients of front and center/surround channels
+	static const float s_downmixFront;
+	static const float s_downmixCenter;
+
+	static unsigned int (*s_findSync)(const uint8_t *p, unsigned int n);
+	static void (*s_interleave16)(int16_t *dst, const int16_t *const *src,
+			unsigned int channels, unsigned int n, int gain);
+	static void (*s_convertFlt)(int16_t *dst, const float *const *src,
+			unsigned int channels, unsigned int n, float gain);
+	static void (*s_downmix51Flt)(int16_t *dst, const float *const *src,
+			unsigned int n, float gain);
+
+	static unsigned int FindSyncC(const uint8_t *p, unsigned int n);
+	static void Interleave16C(int16_t *dst, const int16_t *const *src,
+			unsigned int channels, unsigned int n, int gain);
+	static void ConvertFltC(int16_t *dst, const float *const *src,
+			unsigned int channels, unsigned int n, float gain);
+	static void Downmix51FltC(int16_t *dst, const float *const *src,
+			unsigned int n, float gain);
+#ifdef __SSE2__
+	static unsigned int FindSyncSse2(const uint8_t *p, unsigned int n);
+#endif
+#ifdef AUDIO_DSP_NEON
+	static bool HasNeon(void);
+	static unsigned int FindSyncNeon(const uint8_t *p, unsigned int n);
+	static void Interleave16Neon(int16_t *dst, const int16_t *const *src,
+			unsigned int channels, unsigned int n, int gain);
+	static void ConvertFltNeon(int16_t *dst, const float *const *src,
+			unsigned int channels, unsigned int n, float gain);
+	static void Downmix51FltNeon(int16_t *dst, const float *const *src,
+			unsigned int n, float gain);
+#endif
+};
+
+#endif
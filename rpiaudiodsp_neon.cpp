@@ -0,0 +1,175 @@
+/*
+ * rpihddevice - Enigma2 rpihddevice library for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// NEON implementations of cRpiAudioDsp, this file is compiled with NEON
+// enabled, so it must only contain functions selected by a run time check.
+// They're only built with AUDIO_DSP_NEON, see Makefile.
+
+#include "rpiaudiodsp.h"
+
+#ifdef AUDIO_DSP_NEON
+
+#if !defined(__ARM_NEON__) && !defined(__ARM_NEON)
+#error "AUDIO_DSP_NEON needs NEON enabled for rpiaudiodsp_neon.cpp, see NEON_CXXFLAGS"
+#endif
+
+#include <arm_neon.h>
+
+unsigned int cRpiAudioDsp::FindSyncNeon(const uint8_t *p, unsigned int n)
+{
+	const uint8x16_t ff = vdupq_n_u8(0xFF);
+	const uint8x16_t b0 = vdupq_n_u8(0x0B);
+	const uint8x16_t f7 = vdupq_n_u8(0x7F);
+	const uint8x16_t l6 = vdupq_n_u8(0x56);
+
+	unsigned int i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		uint8x16_t v = vld1q_u8(p + i);
+		uint8x16_t m = vorrq_u8(
+				vorrq_u8(vceqq_u8(v, ff), vceqq_u8(v, b0)),
+				vorrq_u8(vceqq_u8(v, f7), vceqq_u8(v, l6)));
+
+		uint64x2_t m64 = vreinterpretq_u64_u8(m);
+		uint64_t lo = vgetq_lane_u64(m64, 0);
+		uint64_t hi = vgetq_lane_u64(m64, 1);
+
+		// matching bytes are set to 0xFF, lanes are little endian
+		if (lo)
+			return i + (__builtin_ctzll(lo) >> 3);
+		if (hi)
+			return i + 8 + (__builtin_ctzll(hi) >> 3);
+	}
+	return i + FindSyncC(p + i, n - i);
+}
+
+void cRpiAudioDsp::Interleave16Neon(int16_t *dst, const int16_t *const *src,
+		unsigned int channels, unsigned int n, int gain)
+{
+	unsigned int i = 0;
+	if (channels == 2)
+	{
+		const int16_t *l = src[0], *r = src[1];
+		for (; i + 8 <= n; i += 8)
+		{
+			int16x8x2_t v;
+			v.val[0] = vld1q_s16(l + i);
+			v.val[1] = vld1q_s16(r + i);
+			if (gain < eUnityGain)
+			{
+				// rounding (2 * a * b + 0x8000) >> 16, same as C version
+				v.val[0] = vqrdmulhq_n_s16(v.val[0], gain);
+				v.val[1] = vqrdmulhq_n_s16(v.val[1], gain);
+			}
+			vst2q_s16(dst + 2 * i, v);
+		}
+
+		const int16_t *rest[] = { l + i, r + i };
+		Interleave16C(dst + 2 * i, rest, 2, n - i, gain);
+	}
+	else if (channels == 1 && gain < eUnityGain)
+	{
+		// used to scale samples in place
+		for (; i + 8 <= n; i += 8)
+			vst1q_s16(dst + i, vqrdmulhq_n_s16(vld1q_s16(src[0] + i), gain));
+
+		const int16_t *rest[] = { src[0] + i };
+		Interleave16C(dst + i, rest, 1, n - i, gain);
+	}
+	else
+		Interleave16C(dst, src, channels, n, gain);
+}
+
+// Rounds 4 float samples scaled to 16 bit half away from zero, same as
+// FltToS16(). Conversion to 32 bit saturates, so narrowing with saturation
+// clips the result.
+static inline int32x4_t RoundFlt(float32x4_t v)
+{
+	uint32x4_t half = vorrq_u32(
+			vandq_u32(vreinterpretq_u32_f32(v), vdupq_n_u32(0x80000000)),
+			vdupq_n_u32(0x3F000000));
+	return vcvtq_s32_f32(vaddq_f32(v, vreinterpretq_f32_u32(half)));
+}
+
+static inline int16x8_t FltToS16x8(const float *p, float scale)
+{
+	return vcombine_s16(
+			vqmovn_s32(RoundFlt(vmulq_n_f32(vld1q_f32(p), scale))),
+			vqmovn_s32(RoundFlt(vmulq_n_f32(vld1q_f32(p + 4), scale))));
+}
+
+void cRpiAudioDsp::ConvertFltNeon(int16_t *dst, const float *const *src,
+		unsigned int channels, unsigned int n, float gain)
+{
+	float scale = gain * 32768.0f;
+	unsigned int i = 0;
+	if (channels == 2)
+	{
+		const float *l = src[0], *r = src[1];
+		for (; i + 8 <= n; i += 8)
+		{
+			int16x8x2_t v;
+			v.val[0] = FltToS16x8(l + i, scale);
+			v.val[1] = FltToS16x8(r + i, scale);
+			vst2q_s16(dst + 2 * i, v);
+		}
+
+		const float *rest[] = { l + i, r + i };
+		ConvertFltC(dst + 2 * i, rest, 2, n - i, gain);
+	}
+	else if (channels == 1)
+	{
+		for (; i + 8 <= n; i += 8)
+			vst1q_s16(dst + i, FltToS16x8(src[0] + i, scale));
+
+		const float *rest[] = { src[0] + i };
+		ConvertFltC(dst + i, rest, 1, n - i, gain);
+	}
+	else
+		ConvertFltC(dst, src, channels, n, gain);
+}
+
+void cRpiAudioDsp::Downmix51FltNeon(int16_t *dst, const float *const *src,
+		unsigned int n, float gain)
+{
+	float front = s_downmixFront * gain * 32768.0f;
+	float center = s_downmixCenter * gain * 32768.0f;
+
+	unsigned int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		float32x4_t c = vmulq_n_f32(vld1q_f32(src[2] + i), center);
+		float32x4_t l = vmlaq_n_f32(c, vld1q_f32(src[0] + i), front);
+		float32x4_t r = vmlaq_n_f32(c, vld1q_f32(src[1] + i), front);
+		l = vmlaq_n_f32(l, vld1q_f32(src[4] + i), center);
+		r = vmlaq_n_f32(r, vld1q_f32(src[5] + i), center);
+
+		int16x4x2_t v;
+		v.val[0] = vqmovn_s32(RoundFlt(l));
+		v.val[1] = vqmovn_s32(RoundFlt(r));
+		vst2_s16(dst + 2 * i, v);
+	}
+
+	const float *rest[] = {
+		src[0] + i, src[1] + i, src[2] + i, src[3] + i, src[4] + i, src[5] + i
+	};
+	Downmix51FltC(dst + 2 * i, rest, n - i, gain);
+}
+
+#endif
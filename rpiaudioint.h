@@ -0,0 +1,1972 @@
+/*
+ * rpihddevice - Enigma2 rpihddevice library for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AUDIO_INT_H
+#define AUDIO_INT_H
+
+// Internal classes of the audio decoder, shared with tests and benchmarks.
+
+#include "rpiaudio.h"
+#include "rpiaudiodsp.h"
+#include "omx.h"
+
+#include <syslog.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/log.h>
+#include <libavutil/opt.h>
+
+// ffmpeg's resampling
+#ifdef HAVE_LIBSWRESAMPLE
+#  include <libswresample/swresample.h>
+#  define DO_RESAMPLE
+#endif
+
+// libav's resampling
+#ifdef HAVE_LIBAVRESAMPLE
+#  include <libavresample/avresample.h>
+#  include <libavutil/samplefmt.h>
+#  define DO_RESAMPLE
+#  define SwrContext AVAudioResampleContext
+#  define swr_alloc  avresample_alloc_context
+#  define swr_init   avresample_open
+#  define swr_free   avresample_free
+#  define swr_convert(ctx, dst, out_cnt, src, in_cnt) \
+		avresample_convert(ctx, dst, 0, out_cnt, (uint8_t**)src, 0, in_cnt)
+#endif
+
+// legacy libavcodec
+#if LIBAVCODEC_VERSION_MAJOR < 55
+#  define av_frame_alloc       avcodec_alloc_frame
+#  define av_frame_free        avcodec_free_frame
+#  define av_frame_unref       avcodec_get_frame_defaults
+#  define AV_CODEC_ID_MP3      CODEC_ID_MP3
+#  define AV_CODEC_ID_AC3      CODEC_ID_AC3
+#  define AV_CODEC_ID_EAC3     CODEC_ID_EAC3
+#  define AV_CODEC_ID_AAC      CODEC_ID_AAC
+#  define AV_CODEC_ID_AAC_LATM CODEC_ID_AAC_LATM
+#  define AV_CODEC_ID_DTS      CODEC_ID_DTS
+#  define AVCodecID            CodecID
+#endif
+
+#if LIBAVCODEC_VERSION_MAJOR < 54
+#  define avcodec_free_frame av_free
+#endif
+
+#if LIBAVCODEC_VERSION_MAJOR < 56
+#  define avcodec_free_context av_freep
+#endif
+
+#ifndef AV_CODEC_CAP_DR1
+#  define AV_CODEC_CAP_DR1 CODEC_CAP_DR1
+#endif
+
+// reference counted frames with custom buffer allocation
+#if LIBAVCODEC_VERSION_MAJOR >= 55
+#  define HAVE_GET_BUFFER2
+#endif
+
+// send/receive decoding API
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57, 37, 100)
+#  define HAVE_SEND_RECEIVE
+#endif
+
+// prevent depreciated warnings for >ffmpeg-1.2.x and >libav-9.x
+#if LIBAVCODEC_VERSION_MAJOR > 54
+#  undef FF_API_REQUEST_CHANNELS
+#endif
+}
+
+// size of the parser's ring buffer, must be a power of two
+#define AVPKT_BUFFER_SIZE (KILOBYTE(256))
+
+// size of the area behind the ring buffer mirroring its first bytes, so any
+// audio frame (plus the header of the following one) can be accessed
+// contiguously, even if it wraps around the end of the ring buffer
+#define AVPKT_MIRROR_SIZE (KILOBYTE(64))
+
+// number of PES packets whose PTS can be tracked by the parser, must be a
+// power of two. If all entries are used, further data gets rejected until
+// the decoder consumed some packets.
+#define AVPKT_PTS_ENTRIES 1024
+
+// maximum number of frames the decoder thread fetches from the parser at once
+#define AVPKT_FRAME_BATCH 32
+
+// number of failed frame candidates or skipped bytes after which a parser
+// locked to a codec falls back to detect all supported codecs
+#define AVPKT_LOCK_MAX_FAILURES 8
+#define AVPKT_LOCK_MAX_SKIP (KILOBYTE(8))
+
+// maximum number of decoded frames queued for the render, the queue is
+// further limited by the configured decode ahead time
+#define AVFRAME_QUEUE_SIZE 64
+
+// decoded samples are stored in a pool of recycled buffers, each large enough
+// for the biggest frame of all supported codecs (e.g. 2048 samples of HE-AAC
+// or DTS, 8 channels, float). Frames of any larger size fall back to libav's
+// default allocation. The pool covers all queued frames plus the references
+// held by the decoders.
+#define AVBUF_SAMPLE_BUFFER_SIZE (2048 * 8 * sizeof(float))
+#define AVBUF_POOL_SIZE (AVFRAME_QUEUE_SIZE + 8)
+
+///
+///	MPEG-4 sample rate table.
+///
+static const uint32_t Mpeg4SampleRateTable[16] = {
+		96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+		16000, 12000, 11025,  8000,  7350,     0,     0,     0
+};
+
+/* ------------------------------------------------------------------------- */
+
+static inline uint64_t NowUs(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+/* ------------------------------------------------------------------------- */
+
+#define AV_CH_LAYOUT(ch) ( \
+		ch == 1 ? AV_CH_LAYOUT_MONO    : \
+		ch == 2 ? AV_CH_LAYOUT_STEREO  : \
+		ch == 3 ? AV_CH_LAYOUT_2POINT1 : \
+		ch == 4 ? AV_CH_LAYOUT_4POINT0 : \
+		ch == 5 ? AV_CH_LAYOUT_5POINT0 : \
+		ch == 6 ? AV_CH_LAYOUT_5POINT1 : \
+		ch == 7 ? AV_CH_LAYOUT_6POINT1 : \
+		ch == 8 ? AV_CH_LAYOUT_7POINT1 : 0)
+
+#define AV_SAMPLE_STR(fmt) ( \
+		fmt == AV_SAMPLE_FMT_U8   ? "U8"             : \
+		fmt == AV_SAMPLE_FMT_S16  ? "S16"            : \
+		fmt == AV_SAMPLE_FMT_S32  ? "S32"            : \
+		fmt == AV_SAMPLE_FMT_FLT  ? "float"          : \
+		fmt == AV_SAMPLE_FMT_DBL  ? "double"         : \
+		fmt == AV_SAMPLE_FMT_U8P  ? "U8, planar"     : \
+		fmt == AV_SAMPLE_FMT_S16P ? "S16, planar"    : \
+		fmt == AV_SAMPLE_FMT_S32P ? "S32, planar"    : \
+		fmt == AV_SAMPLE_FMT_FLTP ? "float, planar"  : \
+		fmt == AV_SAMPLE_FMT_DBLP ? "double, planar" : "unknown")
+
+/* ------------------------------------------------------------------------- */
+
+// Prefers the fixed point variant of a decoder if available, since its 16 bit
+// output can be passed to the render without sample format conversion.
+
+static inline AVCodec* FindDecoder(AVCodecID id, const char *fixedPoint)
+{
+	AVCodec *codec = (AVCodec *)avcodec_find_decoder_by_name(fixedPoint);
+	if (codec && codec->id == id && codec->sample_fmts)
+		for (int i = 0; codec->sample_fmts[i] != AV_SAMPLE_FMT_NONE; i++)
+			if (codec->sample_fmts[i] == AV_SAMPLE_FMT_S16 ||
+					codec->sample_fmts[i] == AV_SAMPLE_FMT_S16P)
+				return codec;
+
+	return (AVCodec *)avcodec_find_decoder(id);
+}
+
+/* ------------------------------------------------------------------------- */
+
+// Demultiplexer for AAC audio in LOAS/LATM transport (ISO/IEC 14496-3,
+// 1.7), as used by DVB-T2. The StreamMuxConfig is only parsed if it differs
+// from the cached one. For each frame, the raw AAC access unit can be
+// extracted, to be decoded by the plain AAC decoder with the cached
+// AudioSpecificConfig as extradata. One program with a single layer and one
+// sub frame per AudioMuxElement is supported, as used for broadcasting.
+
+class cRpiLatmDemux
+{
+
+public:
+
+	cRpiLatmDemux() :
+		m_configBits(0),
+		m_ascSize(0),
+		m_version(0),
+		m_channels(0),
+		m_samplingRate(0),
+		m_payloadSize(0),
+		m_data(0),
+		m_pos(0),
+		m_end(0)
+	{
+	}
+
+	// Parses a complete LOAS frame including its 3 byte header. Returns
+	// false if the frame is invalid, not supported or refers to a
+	// StreamMuxConfig which hasn't been received yet.
+
+	bool Parse(const uint8_t *p, unsigned int size, bool extractPayload = false)
+	{
+		m_data = p;
+		m_pos = 24;
+		m_end = size * 8;
+
+		// AudioMuxElement(1): useSameStreamMux
+		if (!Bits(1))
+		{
+			if (!SameConfig())
+			{
+				m_configBits = 0;
+				if (!ParseStreamMuxConfig())
+					return false;
+
+				// cache StreamMuxConfig, bit aligned as in the frame
+				if (m_pos - 25 <= sizeof(m_config) * 8 - 7)
+				{
+					m_configBits = m_pos - 25;
+					memcpy(m_config, p + 3, (m_pos + 7) / 8 - 3);
+				}
+			}
+			else
+				m_pos += m_configBits;
+		}
+		else if (!m_configBits)
+			return false;
+
+		// PayloadLengthInfo()
+		unsigned int length = 0, tmp;
+		do
+		{
+			tmp = Bits(8);
+			length += tmp;
+		}
+		while (tmp == 255 && m_pos < m_end);
+
+		if (m_pos + length * 8 > m_end || length > sizeof(m_payload) -
+				AV_INPUT_BUFFER_PADDING_SIZE)
+			return false;
+
+		// PayloadMux()
+		if (extractPayload)
+		{
+			CopyBits(m_payload, m_pos, length * 8);
+			memset(m_payload + length, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+		}
+		m_payloadSize = length;
+		return true;
+	}
+
+	void Reset(void)
+	{
+		m_configBits = 0;
+	}
+
+	unsigned int GetChannels(void) { return m_channels; }
+	unsigned int GetSamplingRate(void) { return m_samplingRate; }
+
+	// AudioSpecificConfig to be used as decoder extradata, the version is
+	// incremented whenever its content changes
+	const uint8_t* GetConfig(void) { return m_asc; }
+	unsigned int GetConfigSize(void) { return m_ascSize; }
+	unsigned int GetConfigVersion(void) { return m_version; }
+
+	uint8_t* GetPayload(void) { return m_payload; }
+	unsigned int GetPayloadSize(void) { return m_payloadSize; }
+
+private:
+
+	cRpiLatmDemux(const cRpiLatmDemux&);
+	cRpiLatmDemux& operator= (const cRpiLatmDemux&);
+
+	unsigned int Bits(unsigned int n)
+	{
+		unsigned int value = 0;
+		for (; n; n--, m_pos++)
+			value = (value << 1) | (m_pos < m_end ?
+					(m_data[m_pos / 8] >> (7 - m_pos % 8)) & 0x01 : 0);
+		return value;
+	}
+
+	unsigned int LatmValue(void)
+	{
+		unsigned int bytes = Bits(2);
+		unsigned int value = 0;
+		for (unsigned int i = 0; i <= bytes; i++)
+			value = (value << 8) | Bits(8);
+		return value;
+	}
+
+	unsigned int ObjectType(void)
+	{
+		unsigned int type = Bits(5);
+		return type == 31 ? 32 + Bits(6) : type;
+	}
+
+	unsigned int SamplingRate(void)
+	{
+		unsigned int index = Bits(4);
+		return index == 0x0F ? Bits(24) : Mpeg4SampleRateTable[index];
+	}
+
+	// Copies bits from the current frame starting at bit position pos.
+	void CopyBits(uint8_t *dst, unsigned int pos, unsigned int bits)
+	{
+		const uint8_t *src = m_data + pos / 8;
+		unsigned int shift = pos % 8;
+		unsigned int last = (pos + bits - 1) / 8 - pos / 8;
+
+		for (unsigned int i = 0; i < (bits + 7) / 8; i++)
+			dst[i] = (src[i] << shift) |
+					(shift && i < last ? src[i + 1] >> (8 - shift) : 0);
+
+		if (bits % 8)
+			dst[bits / 8] &= 0xFF << (8 - bits % 8);
+	}
+
+	// Checks if the StreamMuxConfig of the current frame is equal to the
+	// cached one, which always starts at bit 25.
+	bool SameConfig(void)
+	{
+		if (!m_configBits || m_end < 25 + m_configBits)
+			return false;
+
+		unsigned int end = 25 + m_configBits;
+		for (unsigned int i = 3; i <= (end - 1) / 8; i++)
+		{
+			uint8_t mask = i == 3 ? 0x7F : 0xFF;
+			if (i == (end - 1) / 8)
+				mask &= 0xFF << (7 - (end - 1) % 8);
+
+			if ((m_data[i] ^ m_config[i - 3]) & mask)
+				return false;
+		}
+		return true;
+	}
+
+	bool ParseStreamMuxConfig(void)
+	{
+		unsigned int audioMuxVersion = Bits(1);
+		if (audioMuxVersion && Bits(1))		// audioMuxVersionA
+			return false;
+
+		if (audioMuxVersion)
+			LatmValue();					// taraBufferFullness
+
+		if (!Bits(1) ||						// allStreamsSameTimeFraming
+				Bits(6) ||					// numSubFrames
+				Bits(4) ||					// numProgram
+				Bits(3))					// numLayer
+			return false;
+
+		unsigned int ascLength = audioMuxVersion ? LatmValue() : 0;
+		unsigned int ascStart = m_pos;
+
+		if (!ParseAudioSpecificConfig(ascStart, ascLength))
+			return false;
+
+		if (audioMuxVersion)
+		{
+			if (m_pos - ascStart > ascLength)
+				return false;
+			m_pos = ascStart + ascLength;
+		}
+
+		uint8_t asc[sizeof(m_asc)];
+		unsigned int ascSize = (m_pos - ascStart + 7) / 8;
+		if (ascSize > sizeof(asc) || m_pos > m_end)
+			return false;
+
+		CopyBits(asc, ascStart, m_pos - ascStart);
+		if (ascSize != m_ascSize || memcmp(asc, m_asc, ascSize))
+		{
+			memcpy(m_asc, asc, ascSize);
+			m_ascSize = ascSize;
+			m_version++;
+		}
+
+		if (Bits(3))						// frameLengthType
+			return false;
+
+		Bits(8);							// latmBufferFullness
+
+		if (Bits(1))						// otherDataPresent
+		{
+			if (audioMuxVersion)
+				LatmValue();				// otherDataLenBits
+			else
+			{
+				unsigned int esc;
+				do
+				{
+					esc = Bits(1);			// otherDataLenEsc
+					Bits(8);				// otherDataLenTmp
+				}
+				while (esc && m_pos < m_end);
+			}
+		}
+
+		if (Bits(1))						// crcCheckPresent
+			Bits(8);						// crcCheckSum
+
+		return m_pos <= m_end;
+	}
+
+	bool ParseAudioSpecificConfig(unsigned int start, unsigned int length)
+	{
+		static const unsigned int channelTable[8] = { 0, 1, 2, 3, 4, 5, 6, 8 };
+
+		unsigned int type = ObjectType();
+		m_samplingRate = SamplingRate();
+		unsigned int channelConfig = Bits(4);
+		bool ps = false, sbr = false;
+
+		// explicit SBR/PS signaling, output rate is the extension rate
+		if (type == 5 || type == 29)
+		{
+			ps = type == 29;
+			sbr = true;
+			m_samplingRate = SamplingRate();
+			type = ObjectType();
+		}
+
+		switch (type)
+		{
+		case 1: case 2: case 3: case 4: case 6: case 7:
+		case 17: case 19: case 20: case 21: case 22: case 23:
+			break;
+		default:
+			return false;
+		}
+
+		// GASpecificConfig()
+		Bits(1);							// frameLengthFlag
+		if (Bits(1))						// dependsOnCoreCoder
+			Bits(14);						// coreCoderDelay
+		bool extensionFlag = Bits(1);
+
+		if (channelConfig > 7)
+			return false;
+
+		m_channels = channelConfig ? channelTable[channelConfig] :
+				ProgramConfigElement(start);
+
+		if (type == 6 || type == 20)
+			Bits(3);						// layerNr
+
+		if (extensionFlag)
+		{
+			if (type == 22)
+				Bits(16);					// numOfSubFrame, layer_length
+			if (type == 17 || type == 19 || type == 20 || type == 23)
+				Bits(3);					// resilience flags
+			Bits(1);						// extensionFlag3
+		}
+
+		// error protection specific config is not supported
+		if (type == 17 || (type >= 19 && type <= 27))
+		{
+			unsigned int epConfig = Bits(2);
+			if (epConfig == 2 || epConfig == 3)
+				return false;
+		}
+
+		// backward compatible SBR signaling, only possible with a known
+		// AudioSpecificConfig length
+		bool explicitSbr = sbr;
+		if (!sbr && type == 2 && length && start + length >= m_pos + 16 &&
+				Bits(11) == 0x2B7 && ObjectType() == 5)
+		{
+			explicitSbr = true;
+			if ((sbr = Bits(1)))			// sbrPresentFlag
+				m_samplingRate = SamplingRate();
+		}
+
+		// implicit SBR signaling, HE-AAC streams usually don't announce the
+		// extension and the decoder outputs the doubled core rate
+		if (!explicitSbr && type == 2 && m_samplingRate <= 24000)
+			m_samplingRate *= 2;
+
+		// parametric stereo is decoded to two channels
+		if (ps && m_channels == 1)
+			m_channels = 2;
+
+		return m_channels && m_samplingRate && m_pos <= m_end;
+	}
+
+	// Skips program_config_element() and returns the number of channels.
+	unsigned int ProgramConfigElement(unsigned int start)
+	{
+		Bits(10);							// tag, object type, sf index
+		unsigned int elements = Bits(4) + Bits(4) + Bits(4);
+		unsigned int lfe = Bits(2);
+		unsigned int assoc = Bits(3);
+		unsigned int cc = Bits(4);
+
+		if (Bits(1))						// mono_mixdown_present
+			Bits(4);
+		if (Bits(1))						// stereo_mixdown_present
+			Bits(4);
+		if (Bits(1))						// matrix_mixdown_idx_present
+			Bits(3);
+
+		unsigned int channels = lfe;
+		for (unsigned int i = 0; i < elements; i++)
+		{
+			channels += Bits(1) ? 2 : 1;	// is_cpe
+			Bits(4);						// element_tag_select
+		}
+		m_pos += lfe * 4 + assoc * 4 + cc * 5;
+
+		// byte alignment relative to start of AudioSpecificConfig
+		m_pos += (8 - (m_pos - start) % 8) % 8;
+
+		unsigned int comment = Bits(8);
+		m_pos += comment * 8;
+
+		return channels;
+	}
+
+	uint8_t			m_config[64];
+	unsigned int	m_configBits;
+
+	uint8_t			m_asc[64];
+	unsigned int	m_ascSize;
+	unsigned int	m_version;
+
+	unsigned int	m_channels;
+	unsigned int	m_samplingRate;
+
+	uint8_t			m_payload[KILOBYTE(8) + AV_INPUT_BUFFER_PADDING_SIZE];
+	unsigned int	m_payloadSize;
+
+	const uint8_t  *m_data;
+	unsigned int	m_pos;
+	unsigned int	m_end;
+};
+
+/* ------------------------------------------------------------------------- */
+
+class cRpiAudioDecoder::cParser
+{
+
+public:
+
+	struct Frame
+	{
+		uint8_t*			data;
+		unsigned int		offset;
+		unsigned int		size;
+		int64_t				pts;
+		cAudioCodec::eCodec codec;
+		unsigned int		channels;
+		unsigned int		samplingRate;
+		unsigned int		coreSize;		// part to be used for decoding
+		unsigned int		coreChannels;	// channels of decoded core
+	};
+
+	cParser() :
+		m_buffer(0),
+		m_packetBuffer(0),
+		m_readPos(0),
+		m_writePos(0),
+		m_ptsRead(0),
+		m_ptsWrite(0),
+		m_size(0),
+		m_substreams(false),
+		m_codecHint(cAudioCodec::eInvalid),
+		m_lockedCodec(cAudioCodec::eInvalid),
+		m_lockFailures(0),
+		m_lockSkipped(0),
+		m_resyncStart(0)
+	{
+		memset(&m_stats, 0, sizeof(m_stats));
+	}
+
+	~cParser()
+	{
+	}
+
+	// The parser is used by exactly one producer (Append()) and one consumer
+	// (all other functions except GetFreeSpace()), so no locking is needed.
+	// Read and write positions are free running byte counters, each of them
+	// only modified by its owner and published with release semantics after
+	// the data or PTS it refers to has been accessed.
+
+	// Fills the given array with up to max complete frames starting at the
+	// current read position, all sharing the same codec parameters. The
+	// frames stay valid until the parser is shrunk or reset, so they can be
+	// released with a single Shrink() of the consumed length afterwards.
+
+	unsigned int GetFrames(Frame *frames, unsigned int max)
+	{
+		// load write position before PTS, so all data has its PTS entry
+		m_size = __atomic_load_n(&m_writePos, __ATOMIC_ACQUIRE) - m_readPos;
+		Parse();
+
+		unsigned int ptsWrite = __atomic_load_n(&m_ptsWrite, __ATOMIC_ACQUIRE);
+		unsigned int ptsIndex = m_ptsRead;
+
+		Header header = m_header;
+		unsigned int count = 0;
+		unsigned int offset = 0;
+
+		while (count < max && header.codec != cAudioCodec::eInvalid &&
+				header.size <= m_size - offset)
+		{
+			// find PTS entry containing the frame start, its PTS is only
+			// valid for the frame if it starts exactly at the entry start
+			unsigned int pos = m_readPos + offset;
+			while (ptsWrite - ptsIndex > 1 && (int)(m_pts[(ptsIndex + 1) &
+					(AVPKT_PTS_ENTRIES - 1)].pos - pos) <= 0)
+				ptsIndex++;
+
+			Pts &pts = m_pts[ptsIndex & (AVPKT_PTS_ENTRIES - 1)];
+
+			Frame &frame = frames[count++];
+			frame.data = Data(offset);
+			frame.offset = offset;
+			frame.size = header.size;
+			frame.pts = ptsIndex != ptsWrite && pts.pos == pos ?
+					pts.pts : OMX_INVALID_PTS;
+			frame.codec = header.codec;
+			frame.channels = header.channels;
+			frame.samplingRate = header.samplingRate;
+			frame.coreSize = header.coreSize;
+			frame.coreChannels = header.coreChannels;
+
+			offset += header.size;
+			if (m_size - offset < 4)
+				break;
+
+			// check following frame the same way as the first one, but stop
+			// at parameter changes to let the caller reconfigure
+			const uint8_t *p = Data(offset);
+			unsigned int n = m_size - offset;
+
+			Header next;
+			if (CheckFrame(FastCheck(p), p, n, next) <= 0 ||
+					next.size + 4 > AVPKT_MIRROR_SIZE ||
+					next.codec != header.codec ||
+					next.channels != header.channels ||
+					next.samplingRate != header.samplingRate)
+				break;
+
+			if (n >= next.size + 4 && !IsFrameStart(p + next.size))
+				break;
+
+			header = next;
+		}
+
+		return count;
+	}
+
+	// Returns true if data has been appended since the last call of
+	// GetFrames().
+
+	bool HasNewData(void)
+	{
+		return __atomic_load_n(&m_writePos, __ATOMIC_SEQ_CST) !=
+				m_readPos + m_size;
+	}
+
+	// Locks the parser to the given codec, so when searching for the next
+	// frame, only its sync word and frame length chain are checked. If no
+	// valid frame can be found this way, the parser falls back to detect
+	// all codecs again and re-locks as soon as a frame of the hinted codec
+	// has been found. eInvalid disables locking.
+
+	void SetCodecHint(cAudioCodec::eCodec codec)
+	{
+		codec = Family(codec);
+		if (codec != m_codecHint)
+		{
+			m_codecHint = codec;
+			m_lockedCodec = codec;
+			m_lockFailures = 0;
+			m_lockSkipped = 0;
+		}
+	}
+
+	void GetResyncStats(cRpiAudioDecoder::ResyncStats &stats)
+	{
+		stats.resyncs = __atomic_load_n(&m_stats.resyncs, __ATOMIC_RELAXED);
+		stats.skippedBytes =
+				__atomic_load_n(&m_stats.skippedBytes, __ATOMIC_RELAXED);
+		stats.resyncTime =
+				__atomic_load_n(&m_stats.resyncTime, __ATOMIC_RELAXED);
+	}
+
+	unsigned int GetFreeSpace(void)
+	{
+		unsigned int writePos = __atomic_load_n(&m_writePos, __ATOMIC_ACQUIRE);
+		unsigned int readPos = __atomic_load_n(&m_readPos, __ATOMIC_ACQUIRE);
+
+		return __atomic_load_n(&m_ptsWrite, __ATOMIC_ACQUIRE) -
+				__atomic_load_n(&m_ptsRead, __ATOMIC_ACQUIRE) <
+				AVPKT_PTS_ENTRIES ? AVPKT_BUFFER_SIZE - (writePos - readPos) : 0;
+	}
+
+	int Init(void)
+	{
+		// ring buffer with mirror area and packet buffer, both padded
+		m_buffer = static_cast<uint8_t*>(av_malloc(AVPKT_BUFFER_SIZE +
+				2 * (AVPKT_MIRROR_SIZE + AV_INPUT_BUFFER_PADDING_SIZE)));
+		if (m_buffer)
+		{
+			memset(m_buffer + AVPKT_BUFFER_SIZE + AVPKT_MIRROR_SIZE, 0,
+					AV_INPUT_BUFFER_PADDING_SIZE);
+			m_packetBuffer = m_buffer + AVPKT_BUFFER_SIZE + AVPKT_MIRROR_SIZE +
+					AV_INPUT_BUFFER_PADDING_SIZE;
+			m_header.codec = cAudioCodec::eInvalid;
+			m_readPos = 0;
+			m_writePos = 0;
+			m_ptsRead = 0;
+			m_ptsWrite = 0;
+			m_size = 0;
+			return 0;
+		}
+		return -1;
+	}
+
+	int DeInit(void)
+	{
+		av_free(m_buffer);
+		m_buffer = 0;
+		m_packetBuffer = 0;
+		return 0;
+	}
+
+	// Frames in the ring buffer are followed by the next frame's data, but
+	// libav's bitstream readers may read up to AV_INPUT_BUFFER_PADDING_SIZE
+	// bytes beyond the end of damaged frames, which must be zero. Returns a
+	// copy of the given frame data followed by zeroed padding, which stays
+	// valid until the next call.
+
+	uint8_t* GetPacket(const uint8_t *data, unsigned int size)
+	{
+		memcpy(m_packetBuffer, data, size);
+		memset(m_packetBuffer + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+		return m_packetBuffer;
+	}
+
+	// Drops all data which has been appended so far.
+
+	void Reset(void)
+	{
+		m_size = __atomic_load_n(&m_writePos, __ATOMIC_ACQUIRE) - m_readPos;
+		Shrink(m_size);
+		m_header.codec = cAudioCodec::eInvalid;
+		m_substreams = false;
+		m_latm.Reset();
+		m_resyncStart = 0;
+	}
+
+	bool Append(const unsigned char *data, int64_t pts, unsigned int length)
+	{
+		if (m_writePos - __atomic_load_n(&m_readPos, __ATOMIC_ACQUIRE) +
+				length > AVPKT_BUFFER_SIZE ||
+				m_ptsWrite - __atomic_load_n(&m_ptsRead, __ATOMIC_ACQUIRE) >=
+				AVPKT_PTS_ENTRIES)
+			return false;
+
+		Write(data, length);
+
+		Pts &entry = m_pts[m_ptsWrite & (AVPKT_PTS_ENTRIES - 1)];
+		entry.pts = pts;
+		entry.pos = m_writePos;
+
+		// publish PTS before data
+		__atomic_store_n(&m_ptsWrite, m_ptsWrite + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&m_writePos, m_writePos + length, __ATOMIC_SEQ_CST);
+		return true;
+	}
+
+	void Shrink(unsigned int length, bool retainPts = false)
+	{
+		// just move the read position, no need to touch the data
+		unsigned int readPos = m_readPos + length;
+		m_size -= length;
+
+		// the first frame's header is not valid anymore
+		if (length)
+			m_header.codec = cAudioCodec::eInvalid;
+
+		// drop all PTS entries whose data has been consumed, the front entry
+		// is kept until its successor starts at or before the read position
+		unsigned int ptsWrite = __atomic_load_n(&m_ptsWrite, __ATOMIC_ACQUIRE);
+		unsigned int ptsRead = m_ptsRead;
+
+		while (ptsWrite - ptsRead > 1 && (int)(m_pts[(ptsRead + 1) &
+				(AVPKT_PTS_ENTRIES - 1)].pos - readPos) <= 0)
+			ptsRead++;
+
+		// clear current PTS since it's not valid anymore after shrinking the
+		// packet, unless it has been requested to move it to the new read
+		// position
+		if (ptsRead != ptsWrite)
+		{
+			Pts &pts = m_pts[ptsRead & (AVPKT_PTS_ENTRIES - 1)];
+			if (pts.pos != readPos)
+			{
+				if (retainPts)
+					pts.pos = readPos;
+				else
+					pts.pts = OMX_INVALID_PTS;
+			}
+		}
+
+		__atomic_store_n(&m_ptsRead, ptsRead, __ATOMIC_RELEASE);
+		__atomic_store_n(&m_readPos, readPos, __ATOMIC_RELEASE);
+	}
+	
+private:
+
+	// tests and benchmarks use the header checks
+	friend class cRpiAudioTest;
+
+	cParser(const cParser&);
+	cParser& operator= (const cParser&);
+
+	struct Pts
+	{
+		int64_t 		pts;
+		unsigned int 	pos;
+	};
+
+	struct Header
+	{
+		cAudioCodec::eCodec codec;
+		unsigned int		channels;
+		unsigned int		samplingRate;
+		unsigned int		size;
+		unsigned int		coreSize;
+		unsigned int		coreChannels;
+	};
+
+	// Returns a pointer to the buffered data at given offset relative to the
+	// current read position. At least AVPKT_MIRROR_SIZE bytes are accessible
+	// contiguously behind the returned pointer.
+
+	uint8_t* Data(unsigned int offset)
+	{
+		return m_buffer + ((m_readPos + offset) & (AVPKT_BUFFER_SIZE - 1));
+	}
+
+	// Copies data to the write position of the ring buffer without
+	// publishing it. Everything written to the beginning of the ring buffer
+	// is copied to the mirror area as well.
+
+	void Write(const unsigned char *data, unsigned int length)
+	{
+		unsigned int pos = m_writePos & (AVPKT_BUFFER_SIZE - 1);
+		while (length)
+		{
+			unsigned int len = AVPKT_BUFFER_SIZE - pos;
+			if (len > length)
+				len = length;
+
+			memcpy(m_buffer + pos, data, len);
+
+			if (pos < AVPKT_MIRROR_SIZE)
+				memcpy(m_buffer + AVPKT_BUFFER_SIZE + pos, data,
+						std::min(len, AVPKT_MIRROR_SIZE - pos));
+
+			pos = (pos + len) & (AVPKT_BUFFER_SIZE - 1);
+			data += len;
+			length -= len;
+		}
+	}
+
+	// Check format of first audio packet in buffer. If format has been
+	// guessed, the header is kept, even if the frame is not yet complete.
+	// The frame is considered to be valid once the buffer contains either
+	// the exact amount of expected data or another valid packet start after
+	// the first frame.
+	// Data in front of a valid packet is skipped by moving the read position.
+	// The header of the first frame is kept until the read position moves,
+	// so subsequent calls only need to check whether the frame is complete.
+
+	void Parse()
+	{
+		Header frame = m_header;
+		unsigned int offset = 0;
+
+		while (m_size - offset >= 4)
+		{
+			const uint8_t *p = Data(offset);
+			unsigned int n = m_size - offset;
+
+			if (frame.codec == cAudioCodec::eInvalid)
+			{
+				// if not in sync, skip all bytes which can't start a sync word
+				unsigned int len = std::min<unsigned int>(n - 3,
+						AVPKT_MIRROR_SIZE);
+				unsigned int skip = m_lockedCodec != cAudioCodec::eInvalid ?
+						FindLockedSync(p, std::min<unsigned int>(len,
+								AVPKT_LOCK_MAX_SKIP - m_lockSkipped)) :
+						cRpiAudioDsp::FindSync(p, len);
+				if (skip)
+				{
+					offset += skip;
+					LockSkipped(skip, false);
+					continue;
+				}
+
+				// if locked, ignore sync words of other codecs
+				cAudioCodec::eCodec codec = FastCheck(p);
+				if (m_lockedCodec != cAudioCodec::eInvalid &&
+						codec != m_lockedCodec)
+					codec = cAudioCodec::eInvalid;
+
+				int ret = CheckFrame(codec, p, n, frame);
+
+				// wait for more data if header is incomplete
+				if (ret < 0)
+					break;
+
+				// frames exceeding the mirror area can't be accessed
+				// contiguously, so they are skipped as well
+				if (!ret || frame.size + 4 > AVPKT_MIRROR_SIZE)
+				{
+					frame.codec = cAudioCodec::eInvalid;
+					++offset;
+					LockSkipped(1, codec != cAudioCodec::eInvalid);
+					continue;
+				}
+			}
+
+			// if there is enough data in buffer, check if predicted next
+			// frame start is valid
+			if (n < frame.size + 4 || IsFrameStart(p + frame.size))
+				break;
+
+			// false sync, continue search right after the assumed frame start
+			frame.codec = cAudioCodec::eInvalid;
+			++offset;
+			LockSkipped(1, true);
+		}
+
+		if (offset)
+		{
+			Shrink(offset, true);
+
+			__atomic_add_fetch(&m_stats.skippedBytes, offset, __ATOMIC_RELAXED);
+			if (!m_resyncStart)
+			{
+				m_resyncStart = cTimeMs::Now();
+				__atomic_add_fetch(&m_stats.resyncs, 1, __ATOMIC_RELAXED);
+			}
+		}
+
+		m_header = frame;
+		if (frame.codec != cAudioCodec::eInvalid)
+		{
+			if (m_resyncStart)
+			{
+				__atomic_add_fetch(&m_stats.resyncTime,
+						cTimeMs::Now() - m_resyncStart, __ATOMIC_RELAXED);
+				m_resyncStart = 0;
+			}
+
+			// (re-)lock to hinted codec
+			if (Family(frame.codec) == m_codecHint)
+			{
+				m_lockedCodec = m_codecHint;
+				m_lockFailures = 0;
+				m_lockSkipped = 0;
+			}
+		}
+	}
+
+	// Returns true if a frame of the locked codec, or of any codec if not
+	// locked, starts at the given position.
+
+	bool IsFrameStart(const uint8_t *p)
+	{
+		cAudioCodec::eCodec codec = FastCheck(p);
+		return m_lockedCodec != cAudioCodec::eInvalid ?
+				codec == m_lockedCodec : codec != cAudioCodec::eInvalid;
+	}
+
+	// Returns the number of bytes in front of the first possible sync word
+	// of the locked codec, or n if there's none.
+
+	unsigned int FindLockedSync(const uint8_t *p, unsigned int n)
+	{
+		int sync =
+				m_lockedCodec == cAudioCodec::eAC3      ? 0x0B :
+				m_lockedCodec == cAudioCodec::eAAC_LATM ? 0x56 :
+				m_lockedCodec == cAudioCodec::eDTS      ? 0x7F : 0xFF;
+
+		const uint8_t *q = static_cast<const uint8_t*>(memchr(p, sync, n));
+		return q ? q - p : n;
+	}
+
+	// Accounts skipped data and failed frame candidates while the parser is
+	// locked and falls back to full detection if limits are exceeded.
+
+	void LockSkipped(unsigned int length, bool failed)
+	{
+		if (m_lockedCodec == cAudioCodec::eInvalid)
+			return;
+
+		m_lockSkipped += length;
+		if (failed)
+			m_lockFailures++;
+
+		if (m_lockFailures >= AVPKT_LOCK_MAX_FAILURES ||
+				m_lockSkipped >= AVPKT_LOCK_MAX_SKIP)
+		{
+			syslog(LOG_INFO, "[cRpiAudioDecoder] no %s frame found, "
+					"detecting all audio codecs", cAudioCodec::Str(m_lockedCodec));
+			m_lockedCodec = cAudioCodec::eInvalid;
+		}
+	}
+
+	// Maps a codec to the codec family reported by FastCheck().
+
+	static cAudioCodec::eCodec Family(cAudioCodec::eCodec codec)
+	{
+		switch (codec)
+		{
+		case cAudioCodec::eEAC3:
+			return cAudioCodec::eAC3;
+		case cAudioCodec::eMPG:
+		case cAudioCodec::eAC3:
+		case cAudioCodec::eAAC:
+		case cAudioCodec::eAAC_LATM:
+		case cAudioCodec::eDTS:
+			return codec;
+		default:
+			return cAudioCodec::eInvalid;
+		}
+	}
+
+	// Checks the header of a frame of given codec family. Returns 1 if the
+	// header is valid, 0 if it's invalid and -1 if n is too small to hold
+	// the complete header.
+
+	int CheckFrame(cAudioCodec::eCodec codec, const uint8_t *p,
+			unsigned int n, Header &frame)
+	{
+		// 0xFFE...      MPEG audio
+		// 0x0B77...     (E)AC-3 audio
+		// 0xFFF...      AAC audio
+		// 0x7FFE8001... DTS audio
+		// PCM audio can't be found
+
+		frame.codec = cAudioCodec::eInvalid;
+		frame.coreSize = 0;
+
+		switch (codec)
+		{
+		case cAudioCodec::eMPG:
+			if (n < 4)
+				return -1;
+			if (MpegCheck(p, n, frame.size, frame.channels, frame.samplingRate))
+				frame.codec = cAudioCodec::eMPG;
+			break;
+
+		case cAudioCodec::eAC3:
+			if (n < 8)
+				return -1;
+			if (Ac3Check(p, n, frame.size, frame.channels, frame.samplingRate))
+			{
+				frame.codec = p[5] > (10 << 3) ?
+						cAudioCodec::eEAC3 : cAudioCodec::eAC3;
+
+				// add dependent and further independent substreams
+				int ret = Eac3Substreams(p, n, frame);
+				if (ret <= 0)
+				{
+					frame.codec = cAudioCodec::eInvalid;
+					return ret;
+				}
+			}
+			break;
+
+		case cAudioCodec::eAAC:
+			if (n < 6)
+				return -1;
+			if (AdtsCheck(p, n, frame.size, frame.channels, frame.samplingRate))
+				frame.codec = cAudioCodec::eAAC;
+			break;
+
+		case cAudioCodec::eAAC_LATM:
+			// the whole frame is needed to parse the StreamMuxConfig
+			if (n < 3 || n < (((p[1] & 0x1F) << 8) | p[2]) + 3u)
+				return -1;
+			if (LatmCheck(p, n, frame.size, frame.channels, frame.samplingRate))
+				frame.codec = cAudioCodec::eAAC_LATM;
+			break;
+
+		case cAudioCodec::eDTS:
+			if (n < 11)
+				return -1;
+			if (DtsCheck(p, n, frame.size, frame.channels, frame.samplingRate))
+			{
+				frame.codec = cAudioCodec::eDTS;
+
+				// add DTS-HD extension substreams
+				int ret = DtsHdSubstreams(p, n, frame);
+				if (ret <= 0)
+				{
+					frame.codec = cAudioCodec::eInvalid;
+					return ret;
+				}
+			}
+			break;
+
+		default:
+			break;
+		}
+
+		// a frame must at least contain its header
+		if (frame.size < 4)
+			frame.codec = cAudioCodec::eInvalid;
+
+		// without extensions, the whole frame will be decoded
+		if (!frame.coreSize)
+		{
+			frame.coreSize = frame.size;
+			frame.coreChannels = frame.channels;
+		}
+
+		return frame.codec != cAudioCodec::eInvalid ? 1 : 0;
+	}
+
+	Header				m_header;
+	uint8_t*			m_buffer;
+	uint8_t*			m_packetBuffer;	// padded copy of a frame for decoding
+	unsigned int		m_readPos;
+	unsigned int		m_writePos;
+	Pts					m_pts[AVPKT_PTS_ENTRIES];
+	unsigned int		m_ptsRead;
+	unsigned int		m_ptsWrite;
+	unsigned int		m_size;
+	bool				m_substreams;
+	cRpiLatmDemux		m_latm;
+
+	cAudioCodec::eCodec m_codecHint;
+	cAudioCodec::eCodec m_lockedCodec;
+	unsigned int		m_lockFailures;
+	unsigned int		m_lockSkipped;
+
+	uint64_t			m_resyncStart;
+	cRpiAudioDecoder::ResyncStats m_stats;
+
+	/* ---------------------------------------------------------------------- */
+	/*     audio codec parser helper functions, based on e2-rpihddevice       */
+	/* ---------------------------------------------------------------------- */
+
+	static const uint16_t BitRateTable[2][3][16];
+	static const uint16_t MpegSampleRateTable[4];
+	static const uint16_t Ac3SampleRateTable[4];
+	static const uint16_t Ac3FrameSizeTable[38][3];
+	static const uint32_t DtsSampleRateTable[16];
+
+	static cAudioCodec::eCodec FastCheck(const uint8_t *p)
+	{
+		return 	FastMpegCheck(p)  ? cAudioCodec::eMPG      :
+				FastAc3Check (p)  ? cAudioCodec::eAC3      :
+				FastAdtsCheck(p)  ? cAudioCodec::eAAC      :
+				FastLatmCheck(p)  ? cAudioCodec::eAAC_LATM :
+				FastDtsCheck (p)  ? cAudioCodec::eDTS      :
+									cAudioCodec::eInvalid;
+	}
+
+	///
+	///	Fast check for MPEG audio.
+	///
+	///	0xFFE... MPEG audio
+	///
+	static bool FastMpegCheck(const uint8_t *p)
+	{
+		if (p[0] != 0xFF)			// 11bit frame sync
+			return false;
+		if ((p[1] & 0xE0) != 0xE0)
+			return false;
+		if ((p[1] & 0x18) == 0x08)	// version ID - 01 reserved
+			return false;
+		if (!(p[1] & 0x06))			// layer description - 00 reserved
+			return false;
+		if ((p[2] & 0xF0) == 0xF0)	// bit rate index - 1111 reserved
+			return false;
+		if ((p[2] & 0x0C) == 0x0C)	// sampling rate index - 11 reserved
+			return false;
+		return true;
+	}
+
+	///	Check for MPEG audio.
+	///
+	///	0xFFEx already checked.
+	///
+	///	From: http://www.mpgedit.org/mpgedit/mpeg_format/mpeghdr.htm
+	///
+	///	AAAAAAAA AAABBCCD EEEEFFGH IIJJKLMM
+	///
+	///	o a 11x Frame sync
+	///	o b 2x	MPEG audio version (2.5, reserved, 2, 1)
+	///	o c 2x	Layer (reserved, III, II, I)
+	///	o e 2x	BitRate index
+	///	o f 2x	SampleRate index (41000, 48000, 32000, 0)
+	///	o g 1x	Padding bit
+	/// o h 1x  Private bit
+	/// o i 2x  Channel mode
+	///	o ..	Doesn't care
+	///
+	///	frame length:
+	///	Layer I:
+	///		FrameLengthInBytes = (12 * BitRate / SampleRate + Padding) * 4
+	///	Layer II & III:
+	///		FrameLengthInBytes = 144 * BitRate / SampleRate + Padding
+	///
+	static bool MpegCheck(const uint8_t *p, unsigned int size,
+			unsigned int &frameSize, unsigned int &channels,
+			unsigned int &samplingRate)
+	{
+		frameSize = size;
+		if (size < 4)
+			return true;
+
+		int cmode = (p[3] >> 6) & 0x03;
+		int mpeg2 = !(p[1] & 0x08) && (p[1] & 0x10);
+		int mpeg25 = !(p[1] & 0x08) && !(p[1] & 0x10);
+		int layer = 4 - ((p[1] >> 1) & 0x03);
+		int padding = (p[2] >> 1) & 0x01;
+
+		// channel mode = [ stereo, joint stereo, dual channel, mono]
+		channels = cmode == 0x03 ? 1 : 2;
+
+		samplingRate = MpegSampleRateTable[(p[2] >> 2) & 0x03];
+		if (!samplingRate)
+			return false;
+
+		samplingRate >>= mpeg2;		// MPEG 2 half rate
+		samplingRate >>= mpeg25;	// MPEG 2.5 quarter rate
+
+		int bit_rate =
+				BitRateTable[mpeg2 | mpeg25][layer - 1][(p[2] >> 4) & 0x0F];
+		if (!bit_rate)
+			return false;
+
+		switch (layer)
+		{
+		case 1:
+			frameSize = (12000 * bit_rate) / samplingRate;
+			frameSize = (frameSize + padding) * 4;
+			break;
+		case 2:
+		case 3:
+		default:
+			frameSize = (144000 * bit_rate) / samplingRate;
+			frameSize = frameSize + padding;
+			break;
+		}
+		return true;
+	}
+
+	///
+	///	Fast check for (E-)AC-3 audio.
+	///
+	///	0x0B77... AC-3 audio
+	///
+	static bool FastAc3Check(const uint8_t *p)
+	{
+		if (p[0] != 0x0B)			// 16bit sync
+			return false;
+		if (p[1] != 0x77)
+			return false;
+		return true;
+	}
+
+	///
+	///	Check for (E-)AC-3 audio.
+	///
+	///	0x0B77xxxxxx already checked.
+	///
+	///	o AC-3 Header
+	///	AAAAAAAA AAAAAAAA BBBBBBBB BBBBBBBB CCDDDDDD EEEEEFFF GGGxxxxx
+	///
+	///	o a 16x Frame sync, always 0x0B77
+	///	o b 16x CRC 16
+	///	o c 2x	Sample rate ( 48000, 44100, 32000, reserved )
+	///	o d 6x	Frame size code
+	///	o e 5x	Bit stream ID
+	///	o f 3x	Bit stream mode
+	/// o g 3x  Audio coding mode
+	///
+	///	o E-AC-3 Header
+	///	AAAAAAAA AAAAAAAA BBCCCDDD DDDDDDDD EEFFGGGH IIIII...
+	///
+	///	o a 16x Frame sync, always 0x0B77
+	///	o b 2x	Frame type
+	///	o c 3x	Sub stream ID
+	///	o d 11x Frame size - 1 in words
+	///	o e 2x	Frame size code
+	///	o f 2x	Frame size code 2
+	/// o g 3x  Channel mode
+	/// 0 h 1x  LFE on
+	///
+	static bool Ac3Check(const uint8_t *p, unsigned int size,
+			unsigned int &frameSize, unsigned int &channels,
+			unsigned int &samplingRate)
+	{
+		frameSize = size;
+		if (size < 7)
+			return true;
+
+		int acmod;
+		bool lfe;
+		int fscod = (p[4] & 0xC0) >> 6;
+
+		samplingRate = Ac3SampleRateTable[fscod];
+
+		if (p[5] > (10 << 3))		// E-AC-3
+		{
+			if (fscod == 0x03)
+			{
+				int fscod2 = (p[4] & 0x30) >> 4;
+				if (fscod2 == 0x03)
+					return false;		// invalid fscod & fscod2
+
+				samplingRate = Ac3SampleRateTable[fscod2] / 2;
+			}
+
+			acmod = (p[4] & 0x0E) >> 1;	// number of channels, LFE excluded
+			lfe = p[4] & 0x01;
+
+			frameSize = ((p[2] & 0x07) << 8) + p[3] + 1;
+			frameSize *= 2;
+		}
+		else						// AC-3
+		{
+			if (fscod == 0x03)		// invalid sample rate
+				return false;
+
+			int frmsizcod = p[4] & 0x3F;
+			if (frmsizcod > 37)		// invalid frame size
+				return false;
+
+			acmod = p[6] >> 5;		// number of channels, LFE excluded
+
+			int lfe_bptr = 51;		// position of LFE bit in header for 2.0
+			if ((acmod & 0x01) && (acmod != 0x01))
+				lfe_bptr += 2;		// skip center mix level
+			if (acmod & 0x04)
+				lfe_bptr += 2;		// skip surround mix level
+			if (acmod == 0x02)
+				lfe_bptr += 2;		// skip surround mode
+			lfe = (p[lfe_bptr / 8] & (1 << (7 - (lfe_bptr % 8))));
+
+			// invalid is checked above
+			frameSize = Ac3FrameSizeTable[frmsizcod][fscod] * 2;
+		}
+
+		channels =
+			acmod == 0x00 ? 2 : 	// Ch1, Ch2
+			acmod == 0x01 ? 1 : 	// C
+			acmod == 0x02 ? 2 : 	// L, R
+			acmod == 0x03 ? 3 : 	// L, C, R
+			acmod == 0x04 ? 3 : 	// L, R, S
+			acmod == 0x05 ? 4 : 	// L, C, R, S
+			acmod == 0x06 ? 4 : 	// L, R, RL, RR
+			acmod == 0x07 ? 5 : 0;	// L, C, R, RL, RR
+
+		if (lfe) channels++;
+		return true;
+	}
+
+	///
+	///	Check for E-AC-3 substreams following an (E-)AC-3 frame.
+	///
+	///	An access unit starts with independent substream 0, which may be
+	///	followed by its dependent substreams and further independent
+	///	substreams with their dependents. All of them are combined to one
+	///	frame, since pass-through requires complete access units. The core
+	///	being decoded locally is independent substream 0 only.
+	///
+	///	o E-AC-3 Header, continued
+	///	...      ...JJJJJ KKKKKLMM MMMMMMxx ...
+	///
+	///	o j 5x	Bit stream ID
+	///	o k 5x	Dialog normalization
+	///	o l 1x	Compression gain word exists
+	///	o m 8x	Compression gain word, if l
+	///	o		if channel mode is 1+1: 5x dialnorm2, 1x compr2e, 8x compr2
+	///	o		if dependent substream: 1x chanmape, 16x chanmap, if chanmape
+	///
+	///	Returns 1 if the frame is a valid access unit, 0 if it doesn't start
+	///	with independent substream 0 and -1 if more data is needed. To not
+	///	delay frames of streams without substreams, only if the previous
+	///	access unit contained substreams, the following frame header is
+	///	required to complete an access unit.
+	///
+	int Eac3Substreams(const uint8_t *p, unsigned int size, Header &frame)
+	{
+		// dependent substream or independent substream other than 0
+		if (frame.codec == cAudioCodec::eEAC3 && (p[2] & 0xF8) &&
+				(p[2] & 0xF8) != 0x80)
+			return 0;
+
+		frame.coreSize = frame.size;
+		frame.coreChannels = frame.channels;
+
+		unsigned int channelMap = Ac3ChannelMap(p, frame.channels);
+		bool program0 = true;
+
+		while (true)
+		{
+			if (size < frame.size + 12)
+			{
+				if (m_substreams)
+					return -1;
+				break;
+			}
+
+			const uint8_t *q = p + frame.size;
+			if (!FastAc3Check(q) || q[5] <= (10 << 3))
+				break;
+
+			int strmtyp = q[2] >> 6;
+			if (strmtyp == 0x03)
+				break;
+
+			// next access unit
+			if (strmtyp != 0x01 && !(q[2] & 0x38))
+				break;
+
+			unsigned int frameSize, channels, samplingRate;
+			if (!Ac3Check(q, size - frame.size, frameSize, channels,
+					samplingRate) || samplingRate != frame.samplingRate)
+				break;
+
+			if (strmtyp != 0x01)
+				program0 = false;
+			else if (program0)
+			{
+				// read custom channel map of dependent substream if present
+				unsigned int pos = 51;
+				if (GetBits(q, 50, 1))
+					pos += 8;		// compr
+				if (!(q[4] & 0x0E))
+				{
+					pos += 5;		// dialnorm2
+					if (GetBits(q, pos++, 1))
+						pos += 8;	// compr2
+				}
+				channelMap |= GetBits(q, pos, 1) ? GetBits(q, pos + 1, 16) :
+						Ac3ChannelMap(q, channels);
+			}
+
+			frame.size += frameSize;
+			frame.codec = cAudioCodec::eEAC3;
+		}
+
+		if (size >= frame.size + 12)
+			m_substreams = frame.size != frame.coreSize;
+
+		// pairs of channels are signaled by a single bit
+		frame.channels = __builtin_popcount(channelMap) +
+				__builtin_popcount(channelMap & 0x0674);
+		return 1;
+	}
+
+	static unsigned int GetBits(const uint8_t *p, unsigned int pos,
+			unsigned int n)
+	{
+		unsigned int value = 0;
+		for (; n; n--, pos++)
+			value = (value << 1) | ((p[pos / 8] >> (7 - pos % 8)) & 0x01);
+		return value;
+	}
+
+	///
+	///	Returns the E-AC-3 channel map of the channels coded in a frame.
+	///
+	///	L, C, R, Ls, Rs, Lc/Rc, Lrs/Rrs, Cs, Ts, Lsd/Rsd, Lw/Rw, Vhl/Vhr,
+	///	Vhc, Lts/Rts, LFE2, LFE
+	///
+	static unsigned int Ac3ChannelMap(const uint8_t *p, unsigned int channels)
+	{
+		static const uint16_t acmodMap[8] = {
+			0xA000, 0x4000, 0xA000, 0xE000, 0xA100, 0xE100, 0xB800, 0xF800
+		};
+
+		unsigned int map = acmodMap[p[5] > (10 << 3) ?	// E-AC-3
+				(p[4] & 0x0E) >> 1 : p[6] >> 5];
+
+		// LFE is the only channel not covered by the channel mode
+		if (channels > (unsigned int)__builtin_popcount(map))
+			map |= 0x0001;
+
+		return map;
+	}
+
+	///
+	///	Fast check for AAC LATM audio.
+	///
+	///	0x56E... AAC LATM audio
+	///
+	static bool FastLatmCheck(const uint8_t *p)
+	{
+		if (p[0] != 0x56)			// 11bit sync
+			return false;
+		if ((p[1] & 0xE0) != 0xE0)
+			return false;
+		return true;
+	}
+
+	///
+	///	Check for AAC LATM audio.
+	///
+	///	0x56Exxx already checked.
+	///
+	///	o LOAS AudioSyncStream() header
+	///	AAAAAAAA AAABBBBB BBBBBBBB
+	///
+	///	o a 11x	Sync word, always 0x2B7
+	///	o b 13x	Length of following AudioMuxElement() in bytes
+	///
+	///	Channels and sampling rate are taken from the StreamMuxConfig of
+	///	this or a preceding frame, so the complete frame is required.
+	///
+	bool LatmCheck(const uint8_t *p, unsigned int size,
+			unsigned int &frameSize, unsigned int &channels,
+			unsigned int &samplingRate)
+	{
+		// 13 bit frame size without header
+		frameSize = ((p[1] & 0x1F) << 8) + p[2];
+		frameSize += 3;
+
+		if (size < frameSize || !m_latm.Parse(p, frameSize))
+			return false;
+
+		channels = m_latm.GetChannels();
+		samplingRate = m_latm.GetSamplingRate();
+		return true;
+	}
+	
+	///
+	///	Fast check for ADTS Audio Data Transport Stream.
+	///
+	///	0xFFF...  ADTS audio
+	///
+	static bool FastAdtsCheck(const uint8_t *p)
+	{
+		if (p[0] != 0xFF)			// 12bit sync
+			return false;
+		if ((p[1] & 0xF6) != 0xF0)	// sync + layer must be 0
+			return false;
+		if ((p[2] & 0x3C) == 0x3C)	// sampling frequency index != 15
+			return false;
+		return true;
+	}
+
+	///
+	///	Check for ADTS Audio Data Transport Stream.
+	///
+	///	0xFFF already checked.
+	///
+	///	AAAAAAAA AAAABCCD EEFFFFGH HHIJKLMM MMMMMMMM MMMOOOOO OOOOOOPP
+	///	(QQQQQQQQ QQQQQQQ)
+	///
+	///	o A*12	sync word 0xFFF
+	///	o B*1	MPEG Version: 0 for MPEG-4, 1 for MPEG-2
+	///	o C*2	layer: always 0
+	///	o ..
+	///	o F*4	sampling frequency index (15 is invalid)
+	///	o ..
+	/// o H*3	MPEG-4 channel configuration
+	/// o ...
+	///	o M*13	frame length
+	///
+	static bool AdtsCheck(const uint8_t *p, unsigned int size,
+			unsigned int &frameSize, unsigned int &channels,
+			unsigned int &samplingRate)
+	{
+		frameSize = size;
+		if (size < 6)
+			return true;
+
+		samplingRate = Mpeg4SampleRateTable[(p[2] >> 2) & 0x0F];
+
+		frameSize = (p[3] & 0x03) << 11;
+		frameSize |= (p[4] & 0xFF) << 3;
+		frameSize |= (p[5] & 0xE0) >> 5;
+
+	    int cConf = (p[2] & 0x01) << 7;
+	    cConf |= (p[3] & 0xC0) >> 6;
+	    channels =
+	    	cConf == 0x00 ? 0 : // defined in AOT specific config
+			cConf == 0x01 ? 1 : // C
+	    	cConf == 0x02 ? 2 : // L, R
+	    	cConf == 0x03 ? 3 : // C, L, R
+	    	cConf == 0x04 ? 4 : // C, L, R, RC
+	    	cConf == 0x05 ? 5 : // C, L, R, RL, RR
+	    	cConf == 0x06 ? 6 : // C, L, R, RL, RR, LFE
+	    	cConf == 0x07 ? 8 : // C, L, R, SL, SR, RL, RR, LFE
+				0;
+
+		if (!samplingRate || !channels)
+			return false;
+
+	    return true;
+	}
+
+	///
+	///	Fast check for DTS Audio Data Transport Stream.
+	///
+	///	0x7FFE8001....  DTS audio
+	///
+	static bool FastDtsCheck(const uint8_t *p)
+	{
+		if (p[0] != 0x7F)			// 32bit sync
+			return false;
+		if (p[1] != 0xFE)
+			return false;
+		if (p[2] != 0x80)
+			return false;
+		if (p[3] != 0x01)
+			return false;
+		return true;
+	}
+
+	///
+	///	Check for DTS Audio Data Transport Stream.
+	///
+	///	0x7FFE8001 already checked.
+	///
+	///	AAAAAAAA AAAAAAAA AAAAAAAA AAAAAAAA BCCCCCDE EEEEEEFF FFFFFFFF FFFFGGGG
+	/// GGHHHHII IIIJKLMN OOOPQRRS TTTTTTTT TTTTTTTT UVVVVWWX XXYZaaaa
+	///
+	///	o A*32	sync word 0x7FFE8001
+	///	o B*1   frame type
+	///	o C*5   deficit sample count
+	///	o D*1   CRC present flag
+	///	o E*7   number of PCM sample blocks
+	///	o F*14  primary frame size
+	///	o G*6   audio channel arrangement
+	///	o H*4   core audio sampling frequency
+	///	o I*5   transmission bit rate
+	///	o J*1   embedded downmix enabled
+	///	o K*1   embedded dynamic range flag
+	///	o L*1   embedded time stamp flag
+	///	o M*1   auxiliary data flag
+	///	o N*1   HDCD
+	///	o O*3   extension audio descriptor flag
+	///	o P*1   extended coding flag
+	///	o Q*1   audio sync word insertion flag
+	///	o R*2   low frequency effects flag
+	///	o S*1   predictor history flag
+	///	o T*16  header CRC check (if CRC present flag set)
+	///	o U*1   multi rate interpolator switch
+	///	o V*4   encoder software revision
+	///	o W*2   copy history
+	///	o X*3   source PCM resolution
+	///	o Y*1   front sum/difference flag
+	///	o Z*1   surrounds sum/difference flag
+	///	o a*4   dialog normalization parameter
+	///
+	static bool DtsCheck(const uint8_t *p, unsigned int size,
+			unsigned int &frameSize, unsigned int &channels,
+			unsigned int &samplingRate)
+	{
+		frameSize = size;
+		if (size < 11)
+			return true;
+
+		frameSize = ((p[5] & 0x03) << 12) + (p[6] << 4) + ((p[7] & 0xF0) >> 4);
+		frameSize++;
+
+		samplingRate = DtsSampleRateTable[(p[8] & 0x3C) >> 2];
+
+		int amode = ((p[7] & 0x0F) << 2) + ((p[8] & 0xC0) >> 6);
+		channels =
+			amode == 0x00 ? 1 : 	// mono
+			amode == 0x02 ? 2 : 	// L, R
+			amode == 0x03 ? 2 : 	// (L + R), (L - R)
+			amode == 0x04 ? 2 : 	// LT, RT
+			amode == 0x05 ? 3 : 	// L, R, C
+			amode == 0x06 ? 3 : 	// L, R, S
+			amode == 0x08 ? 4 : 	// L, R, RL, RR
+			amode == 0x09 ? 5 : 0;	// L, C, R, RL, RR
+
+		if (!samplingRate || !channels)
+			return false;
+
+		if (p[10] & 0x06) channels++;
+		return true;
+	}
+
+	///
+	///	Adds the DTS-HD extension substreams following a DTS core frame to
+	///	the access unit. Returns 1 if done, 0 if an extension substream is
+	///	invalid and -1 if more data is needed.
+	///
+	///	AAAAAAAA AAAAAAAA AAAAAAAA AAAAAAAA BBBBBBBB CCDEEEEE EEEFFFFF ...
+	///
+	///	o A*32    sync word 0x64582025
+	///	o B*8     user defined bits
+	///	o C*2     extension substream index
+	///	o D*1     header size type
+	///	o E*8/12  extension substream header size - 1
+	///	o F*16/20 extension substream frame size - 1
+	///	o ..      static fields and asset descriptors
+	///
+	int DtsHdSubstreams(const uint8_t *p, unsigned int size, Header &frame)
+	{
+		frame.coreSize = frame.size;
+		frame.coreChannels = frame.channels;
+
+		while (true)
+		{
+			if (size < frame.size + 16)
+			{
+				if (m_substreams)
+					return -1;
+				break;
+			}
+
+			const uint8_t *q = p + frame.size;
+			if (q[0] != 0x64 || q[1] != 0x58 || q[2] != 0x20 || q[3] != 0x25)
+				break;
+
+			bool wide = GetBits(q, 42, 1);
+			unsigned int headerSize = GetBits(q, 43, wide ? 12 : 8) + 1;
+			unsigned int frameSize = GetBits(q, wide ? 55 : 51,
+					wide ? 20 : 16) + 1;
+
+			if (headerSize < 16 || frameSize < headerSize)
+				return 0;
+			if (size < frame.size + headerSize)
+				return -1;
+
+			// total channel count of first asset, if signaled
+			unsigned int channels = DtsHdChannels(q, wide, headerSize * 8);
+			if (channels > frame.channels)
+				frame.channels = channels;
+
+			frame.size += frameSize;
+		}
+
+		if (size >= frame.size + 16)
+			m_substreams = frame.size != frame.coreSize;
+
+		return 1;
+	}
+
+	///
+	///	Returns the total number of channels of the first audio asset of a
+	///	DTS-HD extension substream, or 0 if the static fields are missing.
+	///	Reads are limited to the given header size in bits, which needs to
+	///	be at least 128.
+	///
+	static unsigned int DtsHdChannels(const uint8_t *p, bool wide,
+			unsigned int bits)
+	{
+		unsigned int index = GetBits(p, 40, 2);
+		unsigned int pos = wide ? 75 : 67;
+
+		if (!GetBits(p, pos++, 1))	// static fields present
+			return 0;
+
+		pos += 5;					// reference clock, frame duration
+		if (GetBits(p, pos++, 1))	// time stamp
+			pos += 36;
+
+		unsigned int presentations = GetBits(p, pos, 3) + 1;
+		unsigned int assets = GetBits(p, pos + 3, 3) + 1;
+		pos += 6;
+
+		unsigned int masks[8];
+		if (pos + 32 > bits)
+			return 0;
+		for (unsigned int i = 0; i < presentations; i++, pos += index + 1)
+			masks[i] = GetBits(p, pos, index + 1);
+
+		for (unsigned int i = 0; i < presentations; i++)
+			for (unsigned int j = 0; j <= index; j++)
+				if (masks[i] & (1 << j))
+					pos += 8;		// active asset mask
+
+		if (pos + 7 > bits)
+			return 0;
+		if (GetBits(p, pos++, 1))	// mix metadata
+		{
+			unsigned int bits = (GetBits(p, pos + 2, 2) + 1) << 2;
+			unsigned int configs = GetBits(p, pos + 4, 2) + 1;
+			pos += 6 + bits * configs;
+		}
+
+		pos += assets * (wide ? 20 : 16);	// asset sizes
+
+		// first asset descriptor
+		if (pos + 55 > bits)
+			return 0;
+		pos += 9 + 3;				// descriptor size, asset index
+		if (GetBits(p, pos++, 1))	// asset type
+			pos += 4;
+		if (GetBits(p, pos++, 1))	// language
+			pos += 24;
+		if (GetBits(p, pos++, 1))	// info text
+			pos += (GetBits(p, pos, 10) + 1) * 8 + 10;
+
+		pos += 5 + 4;				// bit resolution, max sample rate
+		if (pos + 8 > bits)
+			return 0;
+		return GetBits(p, pos, 8) + 1;
+	}
+};
+
+/* ------------------------------------------------------------------------- */
+
+#ifdef HAVE_GET_BUFFER2
+
+// Pool of aligned sample buffers used by the decoders' get_buffer2() callback.
+// Buffers are allocated on first use and returned to the pool when the last
+// reference of a frame is dropped, so steady-state decoding doesn't need any
+// further sample buffer allocation. Buffers may be released by decoder and
+// render thread.
+
+class cRpiAudioDecoder::cBufferPool
+{
+
+public:
+
+	cBufferPool() :
+		m_mutex(new cMutex()),
+		m_numFree(0),
+		m_numAllocated(0),
+		m_numFallbacks(0)
+	{
+	}
+
+	~cBufferPool()
+	{
+		Clear();
+		delete m_mutex;
+	}
+
+	// frees all buffers currently not in use
+	void Clear(void)
+	{
+		m_mutex->Lock();
+		while (m_numFree)
+		{
+			av_free(m_free[--m_numFree]);
+			__atomic_sub_fetch(&m_numAllocated, 1, __ATOMIC_RELAXED);
+		}
+		m_mutex->Unlock();
+	}
+
+	unsigned int GetNumAllocated(void)
+	{
+		return __atomic_load_n(&m_numAllocated, __ATOMIC_RELAXED);
+	}
+
+	unsigned int GetNumFallbacks(void)
+	{
+		return __atomic_load_n(&m_numFallbacks, __ATOMIC_RELAXED);
+	}
+
+	static int GetBuffer(AVCodecContext *context, AVFrame *frame, int flags)
+	{
+		cBufferPool *pool = static_cast<cBufferPool*>(context->opaque);
+		AVSampleFormat format = (AVSampleFormat)frame->format;
+		int channels = context->channels;
+		int size = av_samples_get_buffer_size(NULL, channels,
+				frame->nb_samples, format, 0);
+
+		if (!(context->codec->capabilities & AV_CODEC_CAP_DR1) ||
+				size < 0 || size > (int)AVBUF_SAMPLE_BUFFER_SIZE ||
+				(av_sample_fmt_is_planar(format) &&
+						channels > AV_NUM_DATA_POINTERS) ||
+				!(frame->buf[0] = pool->Get()))
+		{
+			__atomic_add_fetch(&pool->m_numFallbacks, 1, __ATOMIC_RELAXED);
+			return avcodec_default_get_buffer2(context, frame, flags);
+		}
+
+		av_samples_fill_arrays(frame->data, &frame->linesize[0],
+				frame->buf[0]->data, channels, frame->nb_samples, format, 0);
+		frame->extended_data = frame->data;
+		return 0;
+	}
+
+private:
+
+	cBufferPool(const cBufferPool&);
+	cBufferPool& operator= (const cBufferPool&);
+
+	AVBufferRef* Get(void)
+	{
+		uint8_t *data = 0;
+
+		m_mutex->Lock();
+		if (m_numFree)
+			data = m_free[--m_numFree];
+		else if (m_numAllocated < AVBUF_POOL_SIZE)
+		{
+			data = static_cast<uint8_t*>(av_malloc(AVBUF_SAMPLE_BUFFER_SIZE));
+			if (data)
+				__atomic_add_fetch(&m_numAllocated, 1, __ATOMIC_RELAXED);
+		}
+		m_mutex->Unlock();
+
+		if (!data)
+			return 0;
+
+		AVBufferRef *buf = av_buffer_create(data, AVBUF_SAMPLE_BUFFER_SIZE,
+				&Release, this, 0);
+		if (!buf)
+			Release(this, data);
+
+		return buf;
+	}
+
+	static void Release(void *opaque, uint8_t *data)
+	{
+		cBufferPool *pool = static_cast<cBufferPool*>(opaque);
+		pool->m_mutex->Lock();
+		pool->m_free[pool->m_numFree++] = data;
+		pool->m_mutex->Unlock();
+	}
+
+	cMutex		   *m_mutex;
+	uint8_t		   *m_free[AVBUF_POOL_SIZE];
+	unsigned int	m_numFree;
+	unsigned int	m_numAllocated;
+	unsigned int	m_numFallbacks;
+};
+
+#else
+
+// legacy libavcodec, frames are owned by the decoder
+class cRpiAudioDecoder::cBufferPool
+{
+
+public:
+
+	void Clear(void) { }
+	unsigned int GetNumAllocated(void) { return 0; }
+	unsigned int GetNumFallbacks(void) { return 0; }
+};
+
+#endif
+
+#endif
@@ -528,6 +528,10 @@ int cRpiHDMIDisplay::SetMode(int group, int mode)
 void cRpiHDMIDisplay::TvServiceCallback(void *data, unsigned int reason,
 		unsigned int param1, unsigned int param2)
 {
+	// EDID has been read again after hotplug, supported audio formats may
+	// have changed with the connected sink
+	if (reason & VC_HDMI_ATTACHED)
+		cRpiSetup::AudioSinkChanged();
 }
 
 /* ------------------------------------------------------------------------- */
@@ -99,6 +99,13 @@ protected:
 	{
 		SetupStore("AudioPort", m_audio.port);
 		SetupStore("AudioFormat", m_audio.format);
+		SetupStore("AudioDecodeAhead", m_audio.decodeAhead);
+		SetupStore("AudioDecodeLoad", m_audio.decodeLoad);
+		SetupStore("AudioIec61937", m_audio.iec61937);
+		SetupStore("AudioDecoderPriority", m_audio.decoderPriority);
+		SetupStore("AudioDecoderCpu", m_audio.decoderCpu);
+		SetupStore("AudioRenderPriority", m_audio.renderPriority);
+		SetupStore("AudioRenderCpu", m_audio.renderCpu);
 
 		SetupStore("VideoFraming", m_video.framing);
 		SetupStore("Resolution", m_video.resolution);
@@ -211,6 +218,14 @@ void cRpiSetup::SetAudioSetupChangedCallback(void (*callback)(void*), void* data
 	GetInstance()->m_onAudioSetupChangedData = data;
 }
 
+void cRpiSetup::AudioSinkChanged(void)
+{
+	// audio setup needs to be re-evaluated for the capabilities of new sink
+	if (GetInstance()->m_onAudioSetupChanged)
+		GetInstance()->m_onAudioSetupChanged(
+				GetInstance()->m_onAudioSetupChangedData);
+}
+
 void cRpiSetup::SetVideoSetupChangedCallback(void (*callback)(void*), void* data)
 {
 	GetInstance()->m_onVideoSetupChanged = callback;
@@ -218,14 +233,17 @@ void cRpiSetup::SetVideoSetupChangedCallback(void (*callback)(void*), void* data
 }
 
 bool cRpiSetup::IsAudioFormatSupported(cAudioCodec::eCodec codec,
-		int channels, int samplingRate)
+		int channels, int samplingRate, bool extensions)
 {
 	// MPEG-1 layer 2 audio pass-through not supported by audio render
 	// and AAC audio pass-through not yet working
-	if (codec == cAudioCodec::eMPG || codec == cAudioCodec::eAAC)
+	if (codec == cAudioCodec::eMPG || codec == cAudioCodec::eAAC ||
+			codec == cAudioCodec::eAAC_LATM)
 		return false;
 
-	if (channels < 2 || channels > 6)
+	// up to 7.1 channels for compressed formats (e.g. E-AC-3 with dependent
+	// substreams), but multi channel PCM is limited to 5.1
+	if (channels < 2 || channels > (codec == cAudioCodec::ePCM ? 6 : 8))
 		return false;
 
 	switch (GetAudioFormat())
@@ -236,7 +254,8 @@ bool cRpiSetup::IsAudioFormatSupported(cAudioCodec::eCodec codec,
 					codec == cAudioCodec::eAC3  ? EDID_AudioFormat_eAC3   :
 					codec == cAudioCodec::eEAC3 ? EDID_AudioFormat_eEAC3  :
 					codec == cAudioCodec::eAAC  ? EDID_AudioFormat_eAAC   :
-					codec == cAudioCodec::eDTS  ? EDID_AudioFormat_eDTS   :
+					codec == cAudioCodec::eDTS  ? (extensions ?
+							EDID_AudioFormat_eDTS_HD : EDID_AudioFormat_eDTS) :
 							EDID_AudioFormat_ePCM, channels,
 					samplingRate ==  32000 ? EDID_AudioSampleRate_e32KHz  :
 					samplingRate ==  44100 ? EDID_AudioSampleRate_e44KHz  :
@@ -310,6 +329,20 @@ bool cRpiSetup::Parse(const char *name, const char *value)
 		m_audio.port = atoi(value);
 	else if (!strcasecmp(name, "AudioFormat"))
 		m_audio.format = atoi(value);
+	else if (!strcasecmp(name, "AudioDecodeAhead"))
+		m_audio.decodeAhead = atoi(value);
+	else if (!strcasecmp(name, "AudioDecodeLoad"))
+		m_audio.decodeLoad = atoi(value);
+	else if (!strcasecmp(name, "AudioIec61937"))
+		m_audio.iec61937 = atoi(value);
+	else if (!strcasecmp(name, "AudioDecoderPriority"))
+		m_audio.decoderPriority = atoi(value);
+	else if (!strcasecmp(name, "AudioDecoderCpu"))
+		m_audio.decoderCpu = atoi(value);
+	else if (!strcasecmp(name, "AudioRenderPriority"))
+		m_audio.renderPriority = atoi(value);
+	else if (!strcasecmp(name, "AudioRenderCpu"))
+		m_audio.renderCpu = atoi(value);
 	else if (!strcasecmp(name, "VideoFraming"))
 		m_video.framing = atoi(value);
 	else if (!strcasecmp(name, "Resolution"))
@@ -325,12 +358,12 @@ bool cRpiSetup::Parse(const char *name, const char *value)
 
 void cRpiSetup::Set(AudioParameters audio, VideoParameters video)
 {
-	if (audio != m_audio)
-	{
-		m_audio = audio;
-		if (m_onAudioSetupChanged)
-			m_onAudioSetupChanged(m_onAudioSetupChangedData);
-	}
+	// thread priorities and CPUs are applied at the next thread start and
+	// don't require the audio setup to be changed
+	bool audioChanged = audio != m_audio;
+	m_audio = audio;
+	if (audioChanged && m_onAudioSetupChanged)
+		m_onAudioSetupChanged(m_onAudioSetupChangedData);
 
 	if (video != m_video)
 	{
@@ -36,13 +36,30 @@ public:
 	{
 		AudioParameters() :
 			port(0),
-			format(0) { }
+			format(0),
+			decodeAhead(200),
+			decodeLoad(80),
+			iec61937(0),
+			decoderPriority(-15),
+			decoderCpu(-1),
+			renderPriority(-15),
+			renderCpu(-1) { }
 
 		int port;
 		int format;
+		int decodeAhead;
+		int decodeLoad;
+		int iec61937;
+		int decoderPriority;
+		int decoderCpu;
+		int renderPriority;
+		int renderCpu;
 
 		bool operator!=(const AudioParameters& a) {
-			return (a.port != port) || (a.format != format);
+			return (a.port != port) || (a.format != format) ||
+					(a.decodeAhead != decodeAhead) ||
+					(a.decodeLoad != decodeLoad) ||
+					(a.iec61937 != iec61937);
 		}
 	};
 
@@ -87,6 +104,41 @@ public:
 						cAudioFormat::eStereoPCM;
 	}
 
+	// maximum duration of decoded audio buffered ahead of the render in ms
+	static int GetAudioDecodeAhead(void) {
+		return GetInstance()->m_audio.decodeAhead;
+	}
+
+	// share of real time in percent audio decoding may take before quality
+	// is reduced, 0 to disable
+	static int GetAudioDecodeLoad(void) {
+		return GetInstance()->m_audio.decodeLoad;
+	}
+
+	// true if pass-through audio is packed into IEC 61937 bursts and sent
+	// as PCM instead of being handed to the audio render compressed
+	static bool IsAudioIec61937(void) {
+		return GetInstance()->m_audio.iec61937;
+	}
+
+	// nice value and CPU of the audio decoder and render threads, applied
+	// when the threads are started. A negative CPU means any CPU.
+	static int GetAudioDecoderPriority(void) {
+		return GetInstance()->m_audio.decoderPriority;
+	}
+
+	static int GetAudioDecoderCpu(void) {
+		return GetInstance()->m_audio.decoderCpu;
+	}
+
+	static int GetAudioRenderPriority(void) {
+		return GetInstance()->m_audio.renderPriority;
+	}
+
+	static int GetAudioRenderCpu(void) {
+		return GetInstance()->m_audio.renderCpu;
+	}
+
 	static cVideoFraming::eFraming GetVideoFraming(void) {
 		return GetInstance()->m_video.framing == 0 ? cVideoFraming::eFrame :
 			   GetInstance()->m_video.framing == 1 ? cVideoFraming::eCut :
@@ -123,7 +175,7 @@ public:
 	}
 
 	static bool IsAudioFormatSupported(cAudioCodec::eCodec codec,
-			int channels, int samplingRate);
+			int channels, int samplingRate, bool extensions = false);
 
 	static bool IsVideoCodecSupported(cVideoCodec::eCodec codec) {
 		return codec == cVideoCodec::eMPEG2 ? GetInstance()->m_mpeg2Enabled :
@@ -149,6 +201,7 @@ public:
 	void Set(AudioParameters audio, VideoParameters video);
 
 	static void SetAudioSetupChangedCallback(void (*callback)(void*), void* data = 0);
+	static void AudioSinkChanged(void);
 	static void SetVideoSetupChangedCallback(void (*callback)(void*), void* data = 0);
 
 	bool ProcessArgs(int argc, char *argv[]);
@@ -0,0 +1,93 @@
+/*
+ * rpihddevice - Enigma2 rpihddevice library for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "alloccount.h"
+
+// glibc's allocator is called directly, since the functions below replace
+// the standard ones.
+
+extern "C" {
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void *p, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+
+static bool s_counting = false;
+static unsigned int s_allocations = 0;
+
+static inline void CountAllocation(void)
+{
+	if (__atomic_load_n(&s_counting, __ATOMIC_RELAXED))
+		__atomic_add_fetch(&s_allocations, 1, __ATOMIC_RELAXED);
+}
+
+void* malloc(size_t size) __THROW
+{
+	CountAllocation();
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) __THROW
+{
+	CountAllocation();
+	return __libc_calloc(n, size);
+}
+
+void* realloc(void *p, size_t size) __THROW
+{
+	CountAllocation();
+	return __libc_realloc(p, size);
+}
+
+void* memalign(size_t alignment, size_t size) __THROW
+{
+	CountAllocation();
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **p, size_t alignment, size_t size) __THROW
+{
+	CountAllocation();
+	*p = __libc_memalign(alignment, size);
+	return *p ? 0 : ENOMEM;
+}
+
+}
+
+/* ------------------------------------------------------------------------- */
+
+void cAllocCount::Start(void)
+{
+	__atomic_store_n(&s_allocations, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&s_counting, true, __ATOMIC_RELAXED);
+}
+
+void cAllocCount::Stop(void)
+{
+	__atomic_store_n(&s_counting, false, __ATOMIC_RELAXED);
+}
+
+unsigned int cAllocCount::Get(void)
+{
+	return __atomic_load_n(&s_allocations, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,551 @@
+/*
+ * rpihddevice - Enigma2 rpihddevice library for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// Audio decoding benchmark, built by "make bench": decode time per frame
+// (median, 99th percentile and maximum) and heap allocations per frame with
+// sample buffers from libav's default get_buffer2() and from the decoder's
+// buffer pool, and conversion time per frame to the render's stereo 16 bit
+// output, without resampler where the render does so and with resampler.
+// The decoders are selected and set up the same way as by the audio decoder,
+// conversion is also measured with the default decoder if a fixed point one
+// is preferred. Captured elementary streams can be given as arguments,
+// otherwise streams encoded with libav's encoders are used.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "rpiaudiotest.h"
+#include "alloccount.h"
+
+typedef cRpiAudioTest::cParser cParser;
+typedef cRpiAudioTest::cBufferPool cBufferPool;
+
+#define WARMUP_FRAMES	50
+
+/* ------------------------------------------------------------------------- */
+
+// decoders as selected by the audio decoder
+
+static AVCodec* Decoder(cAudioCodec::eCodec codec)
+{
+	return codec == cAudioCodec::eMPG  ? FindDecoder(AV_CODEC_ID_MP3, "mp3") :
+		   codec == cAudioCodec::eAC3  ? FindDecoder(AV_CODEC_ID_AC3, "ac3_fixed") :
+		   codec == cAudioCodec::eEAC3 ? (AVCodec *)avcodec_find_decoder(AV_CODEC_ID_EAC3) :
+		   codec == cAudioCodec::eAAC  ? (AVCodec *)avcodec_find_decoder(AV_CODEC_ID_AAC) :
+		   codec == cAudioCodec::eDTS  ? (AVCodec *)avcodec_find_decoder(AV_CODEC_ID_DTS) :
+		   0;
+}
+
+struct Stream
+{
+	std::string name;
+	AVCodec *codec;
+	std::vector<uint8_t> extraData;
+	std::vector<std::vector<uint8_t> > packets;
+};
+
+static void AddPacket(Stream &stream, const uint8_t *data, unsigned int size)
+{
+	stream.packets.push_back(std::vector<uint8_t>(data, data + size));
+}
+
+// Splits a captured elementary stream into frames with the audio parser.
+
+static bool ReadStream(const char *path, Stream &stream)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return false;
+
+	cParser parser;
+	cParser::Frame frames[AVPKT_FRAME_BATCH];
+	cAudioCodec::eCodec codec = cAudioCodec::eInvalid;
+	uint8_t buf[KILOBYTE(16)];
+	size_t n = 1;
+
+	parser.Init();
+	while (n)
+	{
+		n = parser.GetFreeSpace() >= sizeof(buf) ?
+				fread(buf, 1, sizeof(buf), file) : 0;
+		if (n)
+			parser.Append(buf, 0, n);
+
+		unsigned int count;
+		while ((count = parser.GetFrames(frames, AVPKT_FRAME_BATCH)))
+		{
+			for (unsigned int i = 0; i < count; i++)
+				if (codec == cAudioCodec::eInvalid ||
+						frames[i].codec == codec)
+				{
+					codec = frames[i].codec;
+					AddPacket(stream, frames[i].data, frames[i].size);
+				}
+			parser.Shrink(frames[count - 1].offset + frames[count - 1].size);
+			n = 1;
+		}
+	}
+	parser.DeInit();
+	fclose(file);
+
+	stream.name = path;
+	stream.codec = Decoder(codec);
+	return stream.codec && !stream.packets.empty();
+}
+
+#ifdef HAVE_SEND_RECEIVE
+// Encodes 10s of a sine tone with the given encoder.
+
+static bool EncodeStream(const char *name, cAudioCodec::eCodec codec,
+		AVCodecID id, int channels, int bitRate, Stream &stream)
+{
+	AVCodec *encoder = (AVCodec *)avcodec_find_encoder(id);
+	AVCodecContext *context = encoder && encoder->sample_fmts ?
+			avcodec_alloc_context3(encoder) : 0;
+	if (!context)
+		return false;
+
+	context->sample_rate = 48000;
+	context->channels = channels;
+	context->channel_layout = AV_CH_LAYOUT(channels);
+	context->sample_fmt = encoder->sample_fmts[0];
+	context->bit_rate = bitRate;
+
+	AVFrame *frame = av_frame_alloc();
+	AVPacket *packet = av_packet_alloc();
+	bool ret = frame && packet && avcodec_open2(context, encoder, NULL) >= 0;
+
+	if (ret && context->extradata_size)
+		stream.extraData.assign(context->extradata,
+				context->extradata + context->extradata_size);
+
+	for (int pts = 0; ret && pts < 48000 * 10; pts += context->frame_size)
+	{
+		frame->nb_samples = context->frame_size;
+		frame->format = context->sample_fmt;
+		frame->channel_layout = context->channel_layout;
+		frame->pts = pts;
+		if (av_frame_get_buffer(frame, 0) < 0)
+			break;
+
+		av_samples_set_silence(frame->extended_data, 0, frame->nb_samples,
+				channels, context->sample_fmt);
+		for (int i = 0; i < frame->nb_samples; i++)
+		{
+			float v = sinf((pts + i) * 2 * M_PI * 440 / 48000) * 0.5f;
+			if (context->sample_fmt == AV_SAMPLE_FMT_FLTP)
+				for (int c = 0; c < channels; c++)
+					((float *)frame->extended_data[c])[i] = v;
+			else if (context->sample_fmt == AV_SAMPLE_FMT_S16)
+				for (int c = 0; c < channels; c++)
+					((int16_t *)frame->data[0])[i * channels + c] = v * 32767;
+		}
+
+		ret = avcodec_send_frame(context, frame) >= 0;
+		av_frame_unref(frame);
+
+		while (ret && !avcodec_receive_packet(context, packet))
+		{
+			AddPacket(stream, packet->data, packet->size);
+			av_packet_unref(packet);
+		}
+	}
+
+	av_packet_free(&packet);
+	av_frame_free(&frame);
+	avcodec_free_context(&context);
+
+	stream.name = name;
+	stream.codec = Decoder(codec);
+	return ret && stream.codec && !stream.packets.empty();
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+#define OUT_CHANNELS	2		// render output as for stereo HDMI or analog
+#define MAX_SAMPLES		8192	// per decoded frame
+
+static int16_t s_out[OUT_CHANNELS * MAX_SAMPLES];
+#ifdef DO_RESAMPLE
+static float s_resampled[OUT_CHANNELS][MAX_SAMPLES];
+#endif
+
+// Conversion of decoded frames to the render's output format, directly as
+// done by the render for the formats it handles without resampler and with
+// the resampler configured like by the render.
+
+struct Conversion
+{
+	std::vector<unsigned int> direct;
+	std::vector<unsigned int> resample;
+#ifdef DO_RESAMPLE
+	SwrContext *context;
+	AVSampleFormat format;
+	int channels;
+#endif
+};
+
+static bool ConvertDirect(const AVFrame *frame, int channels)
+{
+	const void *const *src = (const void *const *)frame->extended_data;
+	switch (frame->format)
+	{
+	case AV_SAMPLE_FMT_FLTP:
+		if (channels == 6 && OUT_CHANNELS == 2 &&
+				(frame->channel_layout == AV_CH_LAYOUT_5POINT1 ||
+				 frame->channel_layout == AV_CH_LAYOUT_5POINT1_BACK))
+			cRpiAudioDsp::Downmix51Flt(s_out, (const float *const *)src,
+					frame->nb_samples, 1.0f);
+		else if (channels == OUT_CHANNELS)
+			cRpiAudioDsp::ConvertFlt(s_out, (const float *const *)src,
+					channels, frame->nb_samples, 1.0f);
+		else
+			return false;
+		return true;
+
+	case AV_SAMPLE_FMT_S16P:
+		if (channels != OUT_CHANNELS)
+			return false;
+		cRpiAudioDsp::Interleave16(s_out, (const int16_t *const *)src,
+				channels, frame->nb_samples, cRpiAudioDsp::eUnityGain);
+		return true;
+
+	case AV_SAMPLE_FMT_S16:
+		if (channels != OUT_CHANNELS)
+			return false;
+		memcpy(s_out, src[0], frame->nb_samples * channels * sizeof(int16_t));
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+#ifdef DO_RESAMPLE
+static SwrContext* Resampler(AVSampleFormat format, int channels)
+{
+	SwrContext *context = swr_alloc();
+	if (!context)
+		return 0;
+
+	av_opt_set_int(context, "in_sample_rate", 48000, 0);
+	av_opt_set_int(context, "in_sample_fmt", format, 0);
+	av_opt_set_int(context, "in_channel_count", channels, 0);
+	av_opt_set_int(context, "in_channel_layout", AV_CH_LAYOUT(channels), 0);
+
+	av_opt_set_int(context, "out_sample_rate", 48000, 0);
+	av_opt_set_int(context, "out_sample_fmt", AV_SAMPLE_FMT_FLTP, 0);
+	av_opt_set_int(context, "out_channel_count", OUT_CHANNELS, 0);
+	av_opt_set_int(context, "out_channel_layout",
+			AV_CH_LAYOUT(OUT_CHANNELS), 0);
+
+	if (swr_init(context) < 0)
+		swr_free(&context);
+
+	return context;
+}
+#endif
+
+static void ConvertFrame(Conversion &conversion, AVCodecContext *context,
+		const AVFrame *frame)
+{
+	if (frame->nb_samples > MAX_SAMPLES)
+		return;
+
+	uint64_t start = NowUs();
+	if (ConvertDirect(frame, context->channels))
+		conversion.direct.push_back(NowUs() - start);
+
+#ifdef DO_RESAMPLE
+	if (conversion.context && (conversion.format != frame->format ||
+			conversion.channels != context->channels))
+		swr_free(&conversion.context);
+
+	if (!conversion.context)
+	{
+		conversion.format = (AVSampleFormat)frame->format;
+		conversion.channels = context->channels;
+		conversion.context = Resampler(conversion.format, conversion.channels);
+		if (!conversion.context)
+			return;
+	}
+
+	// to planar float, then to 16 bit with volume applied
+	uint8_t *dst[OUT_CHANNELS];
+	const float *src[OUT_CHANNELS];
+	for (int c = 0; c < OUT_CHANNELS; c++)
+	{
+		dst[c] = (uint8_t *)s_resampled[c];
+		src[c] = s_resampled[c];
+	}
+	start = NowUs();
+	int n = swr_convert(conversion.context, dst, MAX_SAMPLES,
+			(const uint8_t **)frame->extended_data, frame->nb_samples);
+	if (n > 0)
+		cRpiAudioDsp::ConvertFlt(s_out, src, OUT_CHANNELS, n, 1.0f);
+	conversion.resample.push_back(NowUs() - start);
+#endif
+}
+
+/* ------------------------------------------------------------------------- */
+
+// Decodes a packet and drops the decoded frames after converting them, if
+// requested. Returns the number of frames decoded.
+
+static int DecodePacket(AVCodecContext *context, AVPacket *packet,
+		AVFrame *frame, Conversion *conversion)
+{
+#ifdef HAVE_SEND_RECEIVE
+	if (avcodec_send_packet(context, packet) < 0)
+		return 0;
+
+	int frames = 0;
+	while (!avcodec_receive_frame(context, frame))
+	{
+		if (conversion)
+			ConvertFrame(*conversion, context, frame);
+		av_frame_unref(frame);
+		frames++;
+	}
+	return frames;
+#else
+	int gotFrame = 0;
+	if (avcodec_decode_audio4(context, frame, &gotFrame, packet) < 0)
+		return 0;
+
+	if (gotFrame)
+	{
+		if (conversion)
+			ConvertFrame(*conversion, context, frame);
+		av_frame_unref(frame);
+	}
+	return gotFrame;
+#endif
+}
+
+static void PrintTimes(std::vector<unsigned int> &times)
+{
+	std::sort(times.begin(), times.end());
+	printf("p50 %4uus, p99 %4uus, max %5uus", times[times.size() / 2],
+			times[times.size() * 99 / 100], times.back());
+}
+
+// Decodes the whole stream with the decoder set up like by the audio decoder
+// for the render's output and either reports decode time and allocations per
+// frame or the conversion time per frame, if requested.
+
+static void Decode(const Stream &stream, AVCodec *codec, bool usePool,
+		Conversion *conversion)
+{
+	AVCodecContext *context = avcodec_alloc_context3(codec);
+	if (!context)
+		return;
+
+	context->request_sample_fmt = AV_SAMPLE_FMT_S16;
+#if FF_API_REQUEST_CHANNELS
+	context->request_channels = OUT_CHANNELS;
+#endif
+	context->request_channel_layout = AV_CH_LAYOUT(OUT_CHANNELS);
+
+	if (!stream.extraData.empty())
+	{
+		context->extradata = (uint8_t *)av_mallocz(stream.extraData.size() +
+				AV_INPUT_BUFFER_PADDING_SIZE);
+		memcpy(context->extradata, &stream.extraData[0],
+				stream.extraData.size());
+		context->extradata_size = stream.extraData.size();
+	}
+
+	cBufferPool pool;
+#ifdef HAVE_GET_BUFFER2
+	if (usePool)
+	{
+		context->get_buffer2 = &cBufferPool::GetBuffer;
+		context->opaque = &pool;
+	}
+#ifndef HAVE_SEND_RECEIVE
+	context->refcounted_frames = 1;
+#endif
+#endif
+
+	// packets get padded by the parser as for the audio decoder
+	cParser parser;
+	AVFrame *frame = av_frame_alloc();
+	if (!frame || parser.Init() || avcodec_open2(context, codec, NULL) < 0)
+	{
+		printf("  failed to open %s decoder!\n", codec->name);
+		parser.DeInit();
+		av_frame_free(&frame);
+		av_freep(&context->extradata);
+		avcodec_free_context(&context);
+		return;
+	}
+
+	std::vector<unsigned int> times;
+	times.reserve(stream.packets.size());
+	unsigned int frames = 0;
+
+	AVPacket packet;
+	av_init_packet(&packet);
+
+	for (unsigned int i = 0; i < stream.packets.size(); i++)
+	{
+		if (i == WARMUP_FRAMES)
+		{
+			if (!conversion)
+				cAllocCount::Start();
+		}
+
+		uint64_t start = NowUs();
+		packet.size = stream.packets[i].size();
+		packet.data = parser.GetPacket(&stream.packets[i][0], packet.size);
+		int n = DecodePacket(context, &packet, frame,
+				i >= WARMUP_FRAMES ? conversion : 0);
+		if (i >= WARMUP_FRAMES)
+		{
+			times.push_back(NowUs() - start);
+			frames += n;
+		}
+	}
+	cAllocCount::Stop();
+
+	if (conversion)
+	{
+		printf("  %-11s %s %dch to %dch s16, ", codec->name,
+				av_get_sample_fmt_name(context->sample_fmt), context->channels,
+				OUT_CHANNELS);
+		if (!conversion->direct.empty())
+		{
+			printf("direct ");
+			PrintTimes(conversion->direct);
+		}
+		else
+			printf("needs resampler");
+#ifdef DO_RESAMPLE
+		if (!conversion->resample.empty())
+		{
+			printf(", swr ");
+			PrintTimes(conversion->resample);
+		}
+#endif
+		printf("\n");
+	}
+	else if (!times.empty())
+	{
+		printf("  %-7s %s, ", usePool ? "pool" : "default",
+				av_get_sample_fmt_name(context->sample_fmt));
+		PrintTimes(times);
+		printf(", %.2f allocations/frame, %u pool buffers\n",
+				frames ? (double)cAllocCount::Get() / frames : 0.0,
+				pool.GetNumAllocated());
+	}
+
+	parser.DeInit();
+	av_frame_free(&frame);
+	av_freep(&context->extradata);
+	avcodec_free_context(&context);
+}
+
+static void Convert(const Stream &stream, AVCodec *codec)
+{
+	Conversion conversion;
+#ifdef DO_RESAMPLE
+	conversion.context = 0;
+#endif
+	Decode(stream, codec, false, &conversion);
+#ifdef DO_RESAMPLE
+	swr_free(&conversion.context);
+#endif
+}
+
+// Reports decoding with and without buffer pool and the conversion to the
+// render's format, also with the default decoder if the audio decoder prefers
+// a fixed point variant, to compare against float output and resampling.
+
+static void Decode(const Stream &stream)
+{
+	printf("decode %s with %s, %u frames:\n", stream.name.c_str(),
+			stream.codec->name, (unsigned int)stream.packets.size());
+	Decode(stream, stream.codec, false, 0);
+	Decode(stream, stream.codec, true, 0);
+
+	printf("convert to render output per frame:\n");
+	Convert(stream, stream.codec);
+
+	AVCodec *codec = (AVCodec *)avcodec_find_decoder(stream.codec->id);
+	if (codec && codec != stream.codec)
+		Convert(stream, codec);
+}
+
+int main(int argc, char *argv[])
+{
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 10, 100)
+	avcodec_register_all();
+#endif
+	cRpiAudioDsp::Init();
+
+	if (argc < 2)
+	{
+#ifdef HAVE_SEND_RECEIVE
+		static const struct
+		{
+			const char *name;
+			cAudioCodec::eCodec codec;
+			AVCodecID id;
+			int channels;
+			int bitRate;
+		}
+		encoders[] = {
+			{ "MPEG-L2 2.0", cAudioCodec::eMPG,  AV_CODEC_ID_MP2,  2, 192000 },
+			{ "AC-3 5.1",    cAudioCodec::eAC3,  AV_CODEC_ID_AC3,  6, 448000 },
+			{ "E-AC-3 5.1",  cAudioCodec::eEAC3, AV_CODEC_ID_EAC3, 6, 256000 },
+			{ "AAC 2.0",     cAudioCodec::eAAC,  AV_CODEC_ID_AAC,  2, 128000 },
+		};
+
+		for (unsigned int i = 0; i < sizeof(encoders) / sizeof(encoders[0]);
+				i++)
+		{
+			Stream stream;
+			if (EncodeStream(encoders[i].name, encoders[i].codec,
+					encoders[i].id, encoders[i].channels, encoders[i].bitRate,
+					stream))
+				Decode(stream);
+			else
+				printf("failed to encode %s!\n", encoders[i].name);
+		}
+#else
+		printf("usage: %s <audio elementary stream>...\n", argv[0]);
+#endif
+	}
+
+	for (int i = 1; i < argc; i++)
+	{
+		Stream stream;
+		if (ReadStream(argv[i], stream))
+			Decode(stream);
+		else
+			printf("failed to read %s!\n", argv[i]);
+	}
+	return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * rpihddevice - Enigma2 rpihddevice library for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// Audio conversion benchmark, built by "make bench": samples per second of
+// the conversions done by the PCM render path, with the C and NEON kernels
+// and with the resampling library used as fallback, configured the same way
+// as by the render.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rpiaudiotest.h"
+
+#define SAMPLES		1536	// per frame, as for AC-3
+#define LOOPS		4000
+
+static float s_flt[6][SAMPLES];
+static int16_t s_s16[2][SAMPLES];
+static int16_t s_out[6 * SAMPLES];
+
+static void Result(const char *name, uint64_t us)
+{
+	printf("  %-6s %8.1f Msamples/s\n", name,
+			us ? (double)SAMPLES * LOOPS / us : 0.0);
+}
+
+static void Downmix51(const char *name, void (*downmix)(int16_t *dst,
+		const float *const *src, unsigned int n, float gain))
+{
+	const float *src[6] = {
+		s_flt[0], s_flt[1], s_flt[2], s_flt[3], s_flt[4], s_flt[5] };
+
+	uint64_t start = NowUs();
+	for (int i = 0; i < LOOPS; i++)
+		downmix(s_out, src, SAMPLES, 1.0f);
+	Result(name, NowUs() - start);
+}
+
+static void ConvertFlt(const char *name, void (*convert)(int16_t *dst,
+		const float *const *src, unsigned int channels, unsigned int n,
+		float gain))
+{
+	const float *src[2] = { s_flt[0], s_flt[1] };
+
+	uint64_t start = NowUs();
+	for (int i = 0; i < LOOPS; i++)
+		convert(s_out, src, 2, SAMPLES, 1.0f);
+	Result(name, NowUs() - start);
+}
+
+static void Interleave16(const char *name, void (*interleave)(int16_t *dst,
+		const int16_t *const *src, unsigned int channels, unsigned int n,
+		int gain))
+{
+	const int16_t *src[2] = { s_s16[0], s_s16[1] };
+
+	uint64_t start = NowUs();
+	for (int i = 0; i < LOOPS; i++)
+		interleave(s_out, src, 2, SAMPLES, cRpiAudioDsp::eUnityGain);
+	Result(name, NowUs() - start);
+}
+
+#ifdef DO_RESAMPLE
+static void Resample(AVSampleFormat format, int inChannels, int outChannels,
+		const uint8_t **src)
+{
+	SwrContext *context = swr_alloc();
+	if (!context)
+		return;
+
+	av_opt_set_int(context, "in_sample_rate", 48000, 0);
+	av_opt_set_int(context, "in_sample_fmt", format, 0);
+	av_opt_set_int(context, "in_channel_count", inChannels, 0);
+	av_opt_set_int(context, "in_channel_layout", AV_CH_LAYOUT(inChannels), 0);
+
+	av_opt_set_int(context, "out_sample_rate", 48000, 0);
+	av_opt_set_int(context, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+	av_opt_set_int(context, "out_channel_count", outChannels, 0);
+	av_opt_set_int(context, "out_channel_layout",
+			AV_CH_LAYOUT(outChannels), 0);
+
+	if (swr_init(context) < 0)
+	{
+		printf("  failed to initialize resampling context!\n");
+		swr_free(&context);
+		return;
+	}
+
+	uint8_t *dst = (uint8_t *)s_out;
+	uint64_t start = NowUs();
+	for (int i = 0; i < LOOPS; i++)
+		swr_convert(context, &dst, SAMPLES, src, SAMPLES);
+	Result("swr", NowUs() - start);
+
+	swr_free(&context);
+}
+#endif
+
+int main(void)
+{
+	cRpiAudioDsp::Init();
+
+	srand(1);
+	for (int c = 0; c < 6; c++)
+		for (int i = 0; i < SAMPLES; i++)
+			s_flt[c][i] = (float)rand() / RAND_MAX - 0.5f;
+
+	for (int c = 0; c < 2; c++)
+		for (int i = 0; i < SAMPLES; i++)
+			s_s16[c][i] = rand();
+
+#ifdef AUDIO_DSP_NEON
+	bool neon = cRpiAudioTest::HasNeon();
+#endif
+
+	printf("5.1 float planar to stereo S16:\n");
+	Downmix51("C", &cRpiAudioTest::Downmix51FltC);
+#ifdef AUDIO_DSP_NEON
+	if (neon)
+		Downmix51("NEON", &cRpiAudioTest::Downmix51FltNeon);
+#endif
+#ifdef DO_RESAMPLE
+	const uint8_t *flt[6] = {
+		(uint8_t *)s_flt[0], (uint8_t *)s_flt[1], (uint8_t *)s_flt[2],
+		(uint8_t *)s_flt[3], (uint8_t *)s_flt[4], (uint8_t *)s_flt[5] };
+	Resample(AV_SAMPLE_FMT_FLTP, 6, 2, flt);
+#endif
+
+	printf("stereo float planar to S16:\n");
+	ConvertFlt("C", &cRpiAudioTest::ConvertFltC);
+#ifdef AUDIO_DSP_NEON
+	if (neon)
+		ConvertFlt("NEON", &cRpiAudioTest::ConvertFltNeon);
+#endif
+#ifdef DO_RESAMPLE
+	Resample(AV_SAMPLE_FMT_FLTP, 2, 2, flt);
+#endif
+
+	printf("stereo S16 planar to S16:\n");
+	Interleave16("C", &cRpiAudioTest::Interleave16C);
+#ifdef AUDIO_DSP_NEON
+	if (neon)
+		Interleave16("NEON", &cRpiAudioTest::Interleave16Neon);
+#endif
+#ifdef DO_RESAMPLE
+	const uint8_t *s16[2] = { (uint8_t *)s_s16[0], (uint8_t *)s_s16[1] };
+	Resample(AV_SAMPLE_FMT_S16P, 2, 2, s16);
+#endif
+
+	return 0;
+}
@@ -0,0 +1,267 @@
+/*
+ * rpihddevice - Enigma2 rpihddevice library for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// Audio parser benchmarks, built by "make bench":
+//
+// Resync: bytes per second the parser can skip while searching for sync in
+// random data, checking every offset with the fast header checks as done
+// before the sync word scanner, with the scalar and the vectorized scanner
+// and with the complete parser.
+//
+// Parse: bytes per second the parser handles for elementary streams being
+// appended in chunks from TS packet payload up to PES packet size, with the
+// frames fetched after every append like the decoder thread does. As the
+// parser keeps the validated frame boundary between calls, the cost per
+// byte shouldn't depend on the chunk size. Captured AC-3 or MPEG-L2 streams
+// can be given as arguments, otherwise synthetic ones are used.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rpiaudiotest.h"
+
+typedef cRpiAudioTest::cParser cParser;
+
+#define RESYNC_SIZE		KILOBYTE(64)
+#define RESYNC_LOOPS	500
+
+static uint8_t s_random[RESYNC_SIZE + 16];
+
+static void Result(const char *name, uint64_t bytes, uint64_t us,
+		unsigned int hits)
+{
+	printf("  %-16s %8.1f MB/s, %u hits\n", name,
+			us ? (double)bytes / us : 0.0, hits);
+}
+
+static void ResyncFastCheck(void)
+{
+	unsigned int hits = 0;
+	uint64_t start = NowUs();
+
+	for (int loop = 0; loop < RESYNC_LOOPS; loop++)
+		for (unsigned int i = 0; i < RESYNC_SIZE; i++)
+			if (cRpiAudioTest::FastCheck(s_random + i) != cAudioCodec::eInvalid)
+				hits++;
+
+	Result("per offset", (uint64_t)RESYNC_SIZE * RESYNC_LOOPS,
+			NowUs() - start, hits / RESYNC_LOOPS);
+}
+
+static void ResyncScan(const char *name,
+		unsigned int (*findSync)(const uint8_t *p, unsigned int n))
+{
+	unsigned int hits = 0;
+	uint64_t start = NowUs();
+
+	for (int loop = 0; loop < RESYNC_LOOPS; loop++)
+	{
+		unsigned int i = 0;
+		while ((i += findSync(s_random + i, RESYNC_SIZE - i)) < RESYNC_SIZE)
+		{
+			if (cRpiAudioTest::FastCheck(s_random + i) != cAudioCodec::eInvalid)
+				hits++;
+			i++;
+		}
+	}
+
+	Result(name, (uint64_t)RESYNC_SIZE * RESYNC_LOOPS,
+			NowUs() - start, hits / RESYNC_LOOPS);
+}
+
+static void ResyncParser(void)
+{
+	cParser parser;
+	cParser::Frame frames[AVPKT_FRAME_BATCH];
+	unsigned int hits = 0;
+
+	if (parser.Init())
+		return;
+
+	uint64_t start = NowUs();
+	for (int loop = 0; loop < RESYNC_LOOPS; loop++)
+	{
+		parser.Append(s_random, 0, RESYNC_SIZE);
+		unsigned int n;
+		while ((n = parser.GetFrames(frames, AVPKT_FRAME_BATCH)))
+		{
+			hits += n;
+			parser.Shrink(frames[n - 1].offset + frames[n - 1].size);
+		}
+		parser.Reset();
+	}
+	Result("parser", (uint64_t)RESYNC_SIZE * RESYNC_LOOPS,
+			NowUs() - start, hits / RESYNC_LOOPS);
+
+	parser.DeInit();
+}
+
+static void Resync(void)
+{
+	srand(1);
+	for (unsigned int i = 0; i < sizeof(s_random); i++)
+		s_random[i] = rand();
+
+	printf("resync in random data, hits are sync candidates or frames:\n");
+	ResyncFastCheck();
+	ResyncScan("scanner C", &cRpiAudioTest::FindSyncC);
+#ifdef __SSE2__
+	ResyncScan("scanner SSE2", &cRpiAudioTest::FindSyncSse2);
+#endif
+#ifdef AUDIO_DSP_NEON
+	if (cRpiAudioTest::HasNeon())
+		ResyncScan("scanner NEON", &cRpiAudioTest::FindSyncNeon);
+#endif
+	ResyncParser();
+}
+
+/* ------------------------------------------------------------------------- */
+
+#define PARSE_BYTES		MEGABYTE(64)
+
+static const unsigned int s_chunkSizes[] = { 184, 2048, 16384 };
+
+// Synthetic AC-3 (48kHz, 384kbit/s) or MPEG-1 layer 2 (48kHz, 192kbit/s)
+// frames with random payload, which may contain sync words.
+
+static uint8_t* SyntheticStream(bool ac3, unsigned int &size)
+{
+	unsigned int frameSize = ac3 ? 1536 : 576;
+	size = MEGABYTE(1) / frameSize * frameSize;
+
+	uint8_t *data = static_cast<uint8_t*>(malloc(size));
+	if (!data)
+		return 0;
+
+	srand(2);
+	for (unsigned int i = 0; i < size; i++)
+		data[i] = rand();
+
+	for (uint8_t *p = data; p < data + size; p += frameSize)
+	{
+		static const uint8_t ac3Header[] = { 0x0B, 0x77, 0, 0, 0x1C, 8 << 3 };
+		static const uint8_t mpgHeader[] = { 0xFF, 0xFD, 0xA4, 0x00 };
+		if (ac3)
+			memcpy(p, ac3Header, sizeof(ac3Header));
+		else
+			memcpy(p, mpgHeader, sizeof(mpgHeader));
+	}
+	return data;
+}
+
+static uint8_t* ReadStream(const char *path, unsigned int &size)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return 0;
+
+	fseek(file, 0, SEEK_END);
+	long length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	uint8_t *data = length > 0 ? static_cast<uint8_t*>(malloc(length)) : 0;
+	if (data && fread(data, 1, length, file) != (size_t)length)
+	{
+		free(data);
+		data = 0;
+	}
+	fclose(file);
+
+	size = data ? length : 0;
+	return data;
+}
+
+static void ParseStream(cParser &parser, const uint8_t *data,
+		unsigned int size, unsigned int chunkSize)
+{
+	cParser::Frame frames[AVPKT_FRAME_BATCH];
+	unsigned int pos = 0, calls = 0, count = 0;
+	uint64_t bytes = 0;
+
+	parser.Reset();
+	uint64_t start = NowUs();
+	while (bytes < PARSE_BYTES)
+	{
+		unsigned int n = std::min(chunkSize, size - pos);
+		if (parser.Append(data + pos, 0, n))
+		{
+			pos = pos + n < size ? pos + n : 0;
+			bytes += n;
+		}
+
+		calls++;
+		if ((n = parser.GetFrames(frames, AVPKT_FRAME_BATCH)))
+		{
+			count += n;
+			parser.Shrink(frames[n - 1].offset + frames[n - 1].size);
+		}
+		else if (!parser.GetFreeSpace())
+			parser.Reset();
+	}
+	uint64_t us = NowUs() - start;
+
+	printf("  %5u bytes chunks %8.1f MB/s, %u frames, %.2f calls/frame\n",
+			chunkSize, us ? (double)bytes / us : 0.0, count,
+			count ? (double)calls / count : 0.0);
+}
+
+static void Parse(const char *name, const uint8_t *data, unsigned int size)
+{
+	cParser parser;
+	if (!data || !size || parser.Init())
+	{
+		printf("failed to parse %s!\n", name);
+		return;
+	}
+
+	printf("parse %s:\n", name);
+	for (unsigned int i = 0; i < sizeof(s_chunkSizes) /
+			sizeof(s_chunkSizes[0]); i++)
+		ParseStream(parser, data, size, s_chunkSizes[i]);
+
+	parser.DeInit();
+}
+
+int main(int argc, char *argv[])
+{
+	cRpiAudioDsp::Init();
+	Resync();
+
+	unsigned int size;
+	uint8_t *data;
+
+	if (argc < 2)
+	{
+		data = SyntheticStream(true, size);
+		Parse("synthetic AC-3", data, size);
+		free(data);
+
+		data = SyntheticStream(false, size);
+		Parse("synthetic MPEG-L2", data, size);
+		free(data);
+	}
+
+	for (int i = 1; i < argc; i++)
+	{
+		data = ReadStream(argv[i], size);
+		Parse(argv[i], data, size);
+		free(data);
+	}
+	return 0;
+}
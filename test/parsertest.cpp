@@ -0,0 +1,188 @@
+/*
+ * rpihddevice - Enigma2 rpihddevice library for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// Drives the audio parser the same way the decoder thread does and checks
+// that, once initialized, it doesn't allocate any heap memory, neither for
+// data nor for PTS tracking. All allocations through the malloc() family are
+// counted, including those made with new. Built and run by "make test".
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rpiaudiotest.h"
+#include "alloccount.h"
+
+typedef cRpiAudioTest::cParser cParser;
+
+#define NUM_FRAMES		2000
+#define AC3_FRAME_SIZE	1536	// 48kHz, 384kbit/s
+#define MPG_FRAME_SIZE	576		// 48kHz, 192kbit/s
+#define GARBAGE_SIZE	333
+
+static uint8_t s_stream[NUM_FRAMES * (AC3_FRAME_SIZE + GARBAGE_SIZE)];
+static unsigned int s_streamSize = 0;
+static unsigned int s_framePos[NUM_FRAMES];
+
+// Synthetic frames with valid headers and the frame index stored in the
+// header, the payload doesn't contain any sync words.
+
+static void AddFrame(unsigned int index, bool ac3)
+{
+	uint8_t *p = s_stream + s_streamSize;
+	unsigned int size = ac3 ? AC3_FRAME_SIZE : MPG_FRAME_SIZE;
+
+	for (unsigned int i = 0; i < size; i++)
+		p[i] = (i * 7 + index) & 0x3F;
+
+	if (ac3)
+	{
+		p[0] = 0x0B; p[1] = 0x77;		// sync word
+		p[4] = 0x1C;					// 48kHz, 384kbit/s
+		p[5] = 8 << 3;					// bsid
+		p[6] = 7 << 5;					// 3/2 mode
+		p[2] = index & 0xFF;			// CRC1
+		p[3] = index >> 8;
+	}
+	else
+	{
+		p[0] = 0xFF; p[1] = 0xFD;		// MPEG-1 layer 2, no CRC
+		p[2] = 0xA4; p[3] = 0x00;		// 192kbit/s, 48kHz
+		p[4] = index & 0xFF;			// first bytes of audio data
+		p[5] = index >> 8;
+	}
+
+	s_framePos[index] = s_streamSize;
+	s_streamSize += size;
+}
+
+static unsigned int FrameIndex(const cParser::Frame &frame)
+{
+	unsigned int i = frame.codec == cAudioCodec::eAC3 ? 2 : 4;
+	return frame.data[i] | frame.data[i + 1] << 8;
+}
+
+// A frame's PTS belongs either to its start or, if the frame follows data
+// skipped while searching for sync, to the skipped data. This is the
+// preceding frame as well, since it can't be validated by its successor.
+
+static bool ValidPts(int64_t pts, unsigned int index)
+{
+	return pts == OMX_INVALID_PTS || (pts <= s_framePos[index] + 1 &&
+			(!index || pts > s_framePos[index - 1] + 1));
+}
+
+// Appends the whole stream in PES sized chunks with the stream position as
+// PTS and consumes all frames in batches. Returns the number of frames found
+// or -1 if a frame or its PTS doesn't match the stream.
+
+static int Run(cParser &parser)
+{
+	cParser::Frame frames[AVPKT_FRAME_BATCH];
+	unsigned int written = 0, seed = 1;
+	int count = 0;
+
+	parser.Reset();
+	for (;;)
+	{
+		while (written < s_streamSize && parser.GetFreeSpace() > KILOBYTE(8))
+		{
+			seed = seed * 1103515245 + 12345;
+			unsigned int n = 1 + (seed >> 16) % 2500;
+			if (n > s_streamSize - written)
+				n = s_streamSize - written;
+
+			if (!parser.Append(s_stream + written, written + 1, n))
+				return -1;
+			written += n;
+		}
+
+		unsigned int n = parser.GetFrames(frames, AVPKT_FRAME_BATCH);
+		if (!n)
+		{
+			if (written < s_streamSize)
+				continue;
+			break;
+		}
+
+		unsigned int consumed = 0;
+		for (unsigned int i = 0; i < n; i++)
+		{
+			unsigned int index = FrameIndex(frames[i]);
+			if (index >= NUM_FRAMES || frames[i].size !=
+					(frames[i].codec == cAudioCodec::eAC3 ?
+							AC3_FRAME_SIZE : MPG_FRAME_SIZE) ||
+					!ValidPts(frames[i].pts, index))
+				return -1;
+
+			consumed += frames[i].size;
+			count++;
+		}
+		parser.Shrink(consumed);
+	}
+	return count;
+}
+
+int main(void)
+{
+	// AC-3 and MPEG blocks with garbage in between to force resyncs
+	for (unsigned int i = 0; i < NUM_FRAMES; i++)
+	{
+		AddFrame(i, !(i / 500 & 1));
+		if (i % 97 == 5)
+		{
+			memset(s_stream + s_streamSize, 0x42, GARBAGE_SIZE);
+			s_streamSize += GARBAGE_SIZE;
+		}
+	}
+
+	cRpiAudioDsp::Init();
+	cParser parser;
+	if (parser.Init())
+	{
+		printf("failed to initialize parser!\n");
+		return 1;
+	}
+
+	// first pass to warm up everything allocated lazily outside the parser
+	int expected = Run(parser);
+
+	cAllocCount::Start();
+	int found = Run(parser);
+
+	// PTS ring overflow: appends fail without allocating once all entries
+	// are in use, one of them may still be held for the read position
+	uint8_t byte = 0;
+	unsigned int appended = 0;
+	parser.Reset();
+	while (parser.Append(&byte, 1, 1))
+		appended++;
+
+	cAllocCount::Stop();
+	unsigned int allocations = cAllocCount::Get();
+	parser.Reset();
+	parser.DeInit();
+
+	bool ok = expected > NUM_FRAMES * 95 / 100 && found == expected &&
+			appended >= AVPKT_PTS_ENTRIES - 1 && !allocations;
+
+	printf("frames: %d of %d, PTS entries: %u, allocations: %u - %s\n",
+			found, NUM_FRAMES, appended, allocations, ok ? "ok" : "FAILED");
+
+	return ok ? 0 : 1;
+}
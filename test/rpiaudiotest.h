@@ -0,0 +1,88 @@
+/*
+ * rpihddevice - Enigma2 rpihddevice library for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AUDIO_TEST_H
+#define AUDIO_TEST_H
+
+#include "../rpiaudioint.h"
+
+// Access to internals of the audio decoder for tests and benchmarks, which
+// are linked against the library objects. cRpiAudioTest is a friend of the
+// classes involved.
+
+class cRpiAudioTest
+{
+
+public:
+
+	typedef cRpiAudioDecoder::cParser cParser;
+	typedef cRpiAudioDecoder::cBufferPool cBufferPool;
+
+	static cAudioCodec::eCodec FastCheck(const uint8_t *p) {
+		return cParser::FastCheck(p);
+	}
+
+	// implementations of the DSP functions, of which cRpiAudioDsp selects
+	// one at run time
+
+	static unsigned int FindSyncC(const uint8_t *p, unsigned int n) {
+		return cRpiAudioDsp::FindSyncC(p, n);
+	}
+	static void Interleave16C(int16_t *dst, const int16_t *const *src,
+			unsigned int channels, unsigned int n, int gain) {
+		cRpiAudioDsp::Interleave16C(dst, src, channels, n, gain);
+	}
+	static void ConvertFltC(int16_t *dst, const float *const *src,
+			unsigned int channels, unsigned int n, float gain) {
+		cRpiAudioDsp::ConvertFltC(dst, src, channels, n, gain);
+	}
+	static void Downmix51FltC(int16_t *dst, const float *const *src,
+			unsigned int n, float gain) {
+		cRpiAudioDsp::Downmix51FltC(dst, src, n, gain);
+	}
+
+#ifdef __SSE2__
+	static unsigned int FindSyncSse2(const uint8_t *p, unsigned int n) {
+		return cRpiAudioDsp::FindSyncSse2(p, n);
+	}
+#endif
+
+#ifdef AUDIO_DSP_NEON
+	static bool HasNeon(void) {
+		return cRpiAudioDsp::HasNeon();
+	}
+	static unsigned int FindSyncNeon(const uint8_t *p, unsigned int n) {
+		return cRpiAudioDsp::FindSyncNeon(p, n);
+	}
+	static void Interleave16Neon(int16_t *dst, const int16_t *const *src,
+			unsigned int channels, unsigned int n, int gain) {
+		cRpiAudioDsp::Interleave16Neon(dst, src, channels, n, gain);
+	}
+	static void ConvertFltNeon(int16_t *dst, const float *const *src,
+			unsigned int channels, unsigned int n, float gain) {
+		cRpiAudioDsp::ConvertFltNeon(dst, src, channels, n, gain);
+	}
+	static void Downmix51FltNeon(int16_t *dst, const float *const *src,
+			unsigned int n, float gain) {
+		cRpiAudioDsp::Downmix51FltNeon(dst, src, n, gain);
+	}
+#endif
+};
+
+#endif